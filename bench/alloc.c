@@ -0,0 +1,55 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../src/memory.h"
+#include "bench.h"
+
+/* measures heap allocation throughput through spymem_alloc and
+ * spymem_free.  a mix of small struct sizes is allocated in batches and
+ * then freed, the way a sweep releases a generation of garbage.  build
+ * once normally and once with -DSPYMEM_NO_SLABS (one calloc per object)
+ * to compare; see the 'bench' make target */
+
+#define ROUNDS 200
+#define BATCH  50000
+#define NSIZES 4
+
+static void report(const char *name, double elapsed) {
+  long long n = (long long)ROUNDS * BATCH;
+  fprintf(stderr, "%-8s %11lld allocations in %.3fs  (%.1f M allocs/s)\n",
+          name, n, elapsed, n / elapsed / 1e6);
+}
+
+int main(int argc, char **argv) {
+  const char *mode = argc > 1 ? argv[1] : "default";
+  SpyreConfig_T config;
+  spyre_config_defaults(&config);
+  config.nursery_size = 0; /* the batches are freed by hand, not collected */
+
+  SpyreState_T *S = spyre_init(&config);
+  size_t *ids = malloc(sizeof(size_t) * BATCH);
+  size_t types[NSIZES];
+  static const char *names[NSIZES] = {"B1", "B2", "B3", "B4"};
+
+  if (ids == NULL) {
+    exit(EXIT_FAILURE);
+  }
+  for (size_t i = 0; i < NSIZES; i++) {
+    types[i] = make_type(S, names[i], 0, i + 1)->type_id;
+  }
+
+  double start = now();
+  for (int r = 0; r < ROUNDS; r++) {
+    for (size_t i = 0; i < BATCH; i++) {
+      ids[i] = spymem_alloc(S, types[i % NSIZES]);
+    }
+    for (size_t i = 0; i < BATCH; i++) {
+      spymem_free(S, ids[i]);
+    }
+  }
+  report(mode, now() - start);
+
+  free(ids);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,46 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "../src/spyre.h"
+
+/* helpers shared by the benchmarks.  each bench is a single file built
+ * against the VM objects, see the 'bench' make target.  define
+ * _POSIX_C_SOURCE or _DEFAULT_SOURCE before including, for clock_gettime */
+
+/* monotonic time in seconds */
+static inline double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* registers a struct named NAME whose first NLINKS members point to
+ * another NAME and whose remaining NINTS members are ints, one word each */
+static inline SpyreInternalType_T *make_type(SpyreState_T *S, const char *name,
+                                             size_t nlinks, size_t nints) {
+  SpyreInternalType_T *type = calloc(1, sizeof(SpyreInternalType_T));
+  if (type == NULL) {
+    exit(EXIT_FAILURE);
+  }
+  type->type_name = (char *)name;
+  type->nmembers = nlinks + nints;
+  type->members = malloc(sizeof(SpyreInternalMember_T *) * type->nmembers);
+  if (type->members == NULL) {
+    exit(EXIT_FAILURE);
+  }
+  for (size_t i = 0; i < type->nmembers; i++) {
+    type->members[i] = calloc(1, sizeof(SpyreInternalMember_T));
+    if (type->members[i] == NULL) {
+      exit(EXIT_FAILURE);
+    }
+    type->members[i]->type = i < nlinks ? type : get_type(S, "int");
+    type->members[i]->byte_offset = i * sizeof(size_t);
+  }
+  spyre_register_type(S, type);
+  return type;
+}
+
+#endif
@@ -0,0 +1,106 @@
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include "../src/memory.h"
+#include "../src/gc.h"
+#include "bench.h"
+
+/* checks that the heap gives memory back after shrinking.  a linked list
+ * of LIST_LENGTH nodes is built and rooted from the VM stack, then all but
+ * every KEEP_EVERY-th node is unlinked and the heap collected.  the
+ * survivors are spread thinly over every slab, so without compaction the
+ * resident size would stay at its peak.  they are also spread over every
+ * seg_id, which cannot be renumbered, so the table only shrinks once the
+ * list is cut down to its oldest KEEP_OLDEST nodes.  the thinned list is
+ * compacted by a lazy sweep that finishes while its nodes are on the
+ * remembered set, as when the write barrier has recorded them, and each
+ * node's value is checked after every step.  reads /proc, so linux only */
+
+#define LIST_LENGTH 4000000
+#define KEEP_EVERY  64
+#define KEEP_OLDEST 1000
+
+static double resident_mb(void) {
+  unsigned long size, resident;
+  FILE *statm = fopen("/proc/self/statm", "r");
+  if (statm == NULL || fscanf(statm, "%lu %lu", &size, &resident) != 2) {
+    exit(EXIT_FAILURE);
+  }
+  fclose(statm);
+  return resident * (double)sysconf(_SC_PAGESIZE) / (1024 * 1024);
+}
+
+static void report(SpyreState_T *S, const char *when) {
+  fprintf(stderr, "%-10s rss %7.1f MB, %5zu slabs, %9zu seg_ids\n",
+          when, resident_mb(), S->memory->nslabs, S->memory->capacity);
+}
+
+/* walks the list from HEAD, whose values should count down from FIRST in
+ * steps of STEP */
+static void check(SpyreState_T *S, size_t head, size_t first, size_t step) {
+  int64_t expect = (int64_t)first;
+  for (size_t at = head; at != 0; at = ((size_t *)spymem_rawbuf(S, at))[0]) {
+    if (((int64_t *)spymem_rawbuf(S, at))[1] != expect) {
+      fprintf(stderr, "seg_id %zu holds %lld, expected %lld\n", at,
+              (long long)((int64_t *)spymem_rawbuf(S, at))[1], (long long)expect);
+      exit(EXIT_FAILURE);
+    }
+    expect -= (int64_t)step;
+  }
+}
+
+int main(void) {
+  SpyreConfig_T config;
+  spyre_config_defaults(&config);
+  config.nursery_size = 0;
+
+  SpyreState_T *S = spyre_init(&config);
+  SpyreInternalType_T *node = make_type(S, "Node", 1, 1);
+
+  size_t *root = (size_t *)&S->stack[0];
+  S->sp = sizeof(size_t);
+  *root = 0;
+  for (size_t i = 0; i < LIST_LENGTH; i++) {
+    size_t n = spymem_alloc(S, node->type_id);
+    ((size_t *)spymem_rawbuf(S, n))[0] = *root;
+    ((int64_t *)spymem_rawbuf(S, n))[1] = (int64_t)i;
+    *root = n;
+  }
+  spygc_execute(S);
+  report(S, "built");
+
+  size_t at = *root;
+  while (at != 0) {
+    size_t *fields = (size_t *)spymem_rawbuf(S, at);
+    size_t skip = fields[0];
+    for (int i = 1; i < KEEP_EVERY && skip != 0; i++) {
+      skip = ((size_t *)spymem_rawbuf(S, skip))[0];
+    }
+    fields[0] = skip;
+    at = skip;
+  }
+  /* leaves the sweep pending, the next cycle finishes and compacts it */
+  spygc_collect(S);
+  for (at = *root; at != 0; at = ((size_t *)spymem_rawbuf(S, at))[0]) {
+    spygc_remember(S, at);
+  }
+  spygc_execute(S);
+  check(S, *root, LIST_LENGTH - 1, KEEP_EVERY);
+  report(S, "thinned");
+
+  /* the head is the newest node */
+  size_t length = 0;
+  for (at = *root; at != 0; at = ((size_t *)spymem_rawbuf(S, at))[0]) {
+    length++;
+  }
+  for (size_t i = KEEP_OLDEST; i < length; i++) {
+    *root = ((size_t *)spymem_rawbuf(S, *root))[0];
+  }
+  spygc_execute(S);
+  check(S, *root, (LIST_LENGTH - 1) % KEEP_EVERY + (KEEP_OLDEST - 1)*KEEP_EVERY, KEEP_EVERY);
+  report(S, "cut");
+
+  return EXIT_SUCCESS;
+}
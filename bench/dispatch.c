@@ -0,0 +1,124 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bench.h"
+
+/* measures raw interpreter throughput.  two hand-assembled kernels are
+ * written to a temporary bytecode file and run through spyre_execute_file.
+ * build once with the default (threaded) dispatch and once with
+ * -DSPYRE_SWITCH_DISPATCH to compare; see the 'bench' make target */
+
+#define LOOP_ITERATIONS 20000000LL
+#define CALL_ITERATIONS 10000000LL
+
+/* instructions executed per iteration of each kernel */
+#define LOOP_INS_PER_ITER 7
+#define CALL_INS_PER_ITER 12
+
+typedef struct BenchBuffer {
+  uint8_t bytes[256];
+  size_t at;
+} BenchBuffer_T;
+
+static void emit_op(BenchBuffer_T *B, uint8_t op) {
+  B->bytes[B->at++] = op;
+}
+
+static void emit_u64(BenchBuffer_T *B, uint64_t v) {
+  memcpy(&B->bytes[B->at], &v, sizeof(uint64_t));
+  B->at += sizeof(uint64_t);
+}
+
+static void patch_u64(BenchBuffer_T *B, size_t at, uint64_t v) {
+  memcpy(&B->bytes[at], &v, sizeof(uint64_t));
+}
+
+/*     RESL 1
+ *     IPUSH n
+ *     SVL 0
+ * top:
+ *     LDL 0
+ *     IPUSH 1
+ *     ISUB
+ *     DUP
+ *     SVL 0
+ *     ITEST
+ *     JNZ top
+ *     HALT */
+static void build_loop(BenchBuffer_T *B, int64_t n) {
+  size_t top;
+  emit_op(B, INS_RESL);  emit_u64(B, 1);
+  emit_op(B, INS_IPUSH); emit_u64(B, n);
+  emit_op(B, INS_SVL);   emit_u64(B, 0);
+  top = B->at;
+  emit_op(B, INS_LDL);   emit_u64(B, 0);
+  emit_op(B, INS_IPUSH); emit_u64(B, 1);
+  emit_op(B, INS_ISUB);
+  emit_op(B, INS_DUP);
+  emit_op(B, INS_SVL);   emit_u64(B, 0);
+  emit_op(B, INS_ITEST);
+  emit_op(B, INS_JNZ);   emit_u64(B, top);
+  emit_op(B, INS_HALT);
+}
+
+/* same loop, but every iteration also calls a one-argument function
+ * that returns its argument:
+ *
+ * f:  ARG 0
+ *     IRET */
+static void build_call(BenchBuffer_T *B, int64_t n) {
+  size_t top, func, fixup;
+  emit_op(B, INS_RESL);  emit_u64(B, 1);
+  emit_op(B, INS_IPUSH); emit_u64(B, n);
+  emit_op(B, INS_SVL);   emit_u64(B, 0);
+  top = B->at;
+  emit_op(B, INS_LDL);   emit_u64(B, 0);
+  emit_op(B, INS_IPUSH); emit_u64(B, 1);
+  emit_op(B, INS_ISUB);
+  emit_op(B, INS_DUP);
+  emit_op(B, INS_SVL);   emit_u64(B, 0);
+  emit_op(B, INS_IPUSH); emit_u64(B, 7);
+  emit_op(B, INS_CALL);  fixup = B->at; emit_u64(B, 0); emit_u64(B, 1);
+  emit_op(B, INS_IPOP);
+  emit_op(B, INS_ITEST);
+  emit_op(B, INS_JNZ);   emit_u64(B, top);
+  emit_op(B, INS_HALT);
+  func = B->at;
+  emit_op(B, INS_ARG);   emit_u64(B, 0);
+  emit_op(B, INS_IRET);
+  patch_u64(B, fixup, func);
+}
+
+static void run_kernel(const char *mode, const char *name, BenchBuffer_T *B,
+                       long long instructions) {
+  const char *fname = ".spyre_bench_dispatch.spyb";
+  FILE *out = fopen(fname, "wb");
+  if (out == NULL) {
+    fprintf(stderr, "couldn't open '%s' for writing\n", fname);
+    exit(EXIT_FAILURE);
+  }
+  fwrite(B->bytes, 1, B->at, out);
+  fclose(out);
+
+  double start = now();
+  spyre_execute_file(fname, NULL);
+  double elapsed = now() - start;
+  remove(fname);
+
+  fprintf(stderr, "%-8s %-5s %11lld instructions in %.3fs  (%.1f M ins/s)\n",
+          mode, name, instructions, elapsed, instructions / elapsed / 1e6);
+}
+
+int main(int argc, char **argv) {
+  const char *mode = argc > 1 ? argv[1] : "default";
+  BenchBuffer_T loop = {.at = 0}, call = {.at = 0};
+
+  build_loop(&loop, LOOP_ITERATIONS);
+  build_call(&call, CALL_ITERATIONS);
+
+  run_kernel(mode, "loop", &loop, LOOP_ITERATIONS * LOOP_INS_PER_ITER + 4);
+  run_kernel(mode, "call", &call, CALL_ITERATIONS * CALL_INS_PER_ITER + 4);
+
+  return EXIT_SUCCESS;
+}
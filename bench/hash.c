@@ -0,0 +1,67 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include "../src/hash.h"
+#include "bench.h"
+
+/* measures SpyreHash_T insertion and lookup from a thousand to a million
+ * keys, about the sizes of a struct's members up to the label table of a
+ * large assembled program.  keys are generated label names.  every key
+ * is looked up once present and once absent; lookups are reported per
+ * operation so the sizes can be compared directly */
+
+#define MAX_KEYS 1000000
+#define KEY_SIZE 24
+
+static void run(char (*keys)[KEY_SIZE], char (*absent)[KEY_SIZE], size_t n) {
+  SpyreHash_T *table = hash_init();
+  size_t found = 0;
+  double start, insert, hit, miss;
+
+  start = now();
+  for (size_t i = 0; i < n; i++) {
+    hash_insert(table, keys[i], keys[i]);
+  }
+  insert = now() - start;
+
+  start = now();
+  for (size_t i = 0; i < n; i++) {
+    found += hash_get(table, keys[i]) == keys[i];
+  }
+  hit = now() - start;
+
+  start = now();
+  for (size_t i = 0; i < n; i++) {
+    found += hash_get(table, absent[i]) != NULL;
+  }
+  miss = now() - start;
+
+  if (found != n || table->size != n) {
+    fprintf(stderr, "hash: wrong results at %zu keys\n", n);
+    exit(EXIT_FAILURE);
+  }
+
+  fprintf(stderr, "%8zu keys  insert %6.1f ns  hit %6.1f ns  miss %6.1f ns\n",
+          n, insert / n * 1e9, hit / n * 1e9, miss / n * 1e9);
+  hash_free(&table);
+}
+
+int main(void) {
+  char (*keys)[KEY_SIZE] = malloc(sizeof(*keys) * MAX_KEYS);
+  char (*absent)[KEY_SIZE] = malloc(sizeof(*absent) * MAX_KEYS);
+  if (keys == NULL || absent == NULL) {
+    return EXIT_FAILURE;
+  }
+  for (size_t i = 0; i < MAX_KEYS; i++) {
+    snprintf(keys[i], KEY_SIZE, "__L%zu", i);
+    snprintf(absent[i], KEY_SIZE, "__M%zu", i);
+  }
+
+  for (size_t n = 1000; n <= MAX_KEYS; n *= 10) {
+    run(keys, absent, n);
+  }
+
+  free(keys);
+  free(absent);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,94 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include "../src/memory.h"
+#include "../src/gc.h"
+#include "bench.h"
+
+/* times garbage collection over deep heap shapes.  a singly linked list
+ * of LIST_LENGTH nodes and a complete binary tree of depth TREE_DEPTH are
+ * built directly with spymem_alloc and rooted from the VM stack.  the
+ * list is deep enough that a recursive mark would overflow the C stack.
+ * it is also a single chain, so only the tree gains from more mark threads */
+
+#define LIST_LENGTH 1000000
+#define TREE_DEPTH  20
+#define CYCLES      5
+
+static void set_member(SpyreState_T *S, size_t seg_id, size_t index, size_t value) {
+  ((size_t *)spymem_rawbuf(S, seg_id))[index] = value;
+}
+
+static size_t build_list(SpyreState_T *S, SpyreInternalType_T *node) {
+  size_t head = 0;
+  for (size_t i = 0; i < LIST_LENGTH; i++) {
+    size_t n = spymem_alloc(S, node->type_id);
+    set_member(S, n, 0, head);
+    set_member(S, n, 1, i);
+    head = n;
+  }
+  return head;
+}
+
+static size_t build_tree(SpyreState_T *S, SpyreInternalType_T *node, int depth) {
+  size_t n = spymem_alloc(S, node->type_id);
+  if (depth > 1) {
+    set_member(S, n, 0, build_tree(S, node, depth - 1));
+    set_member(S, n, 1, build_tree(S, node, depth - 1));
+  }
+  return n;
+}
+
+static void push_root(SpyreState_T *S, size_t seg_id) {
+  *(size_t *)&S->stack[S->sp] = seg_id;
+  S->sp += sizeof(size_t);
+}
+
+static void time_collection(SpyreState_T *S, const char *name, size_t objects) {
+  double start = now();
+  for (int i = 0; i < CYCLES; i++) {
+    spygc_execute(S);
+  }
+  double elapsed = (now() - start) / CYCLES;
+  fprintf(stderr, "%-5s %2zu threads %8zu live segments, %.2f ms per collection  (%.1f M segs/s)\n",
+          name, S->config.gc_threads, objects, elapsed * 1e3, objects / elapsed / 1e6);
+}
+
+static void run(size_t threads) {
+  SpyreConfig_T config;
+  spyre_config_defaults(&config);
+  config.heap_initial = SIZE_MAX; /* only collect when asked to */
+  config.nursery_size = 0;        /* segments are held in C locals while building */
+  config.gc_threads = threads;
+
+  SpyreState_T *S = spyre_init(&config);
+  SpyreInternalType_T *list_node = make_type(S, "ListNode", 1, 1);
+  SpyreInternalType_T *tree_node = make_type(S, "TreeNode", 2, 1);
+
+  push_root(S, build_list(S, list_node));
+  time_collection(S, "list", LIST_LENGTH);
+
+  S->sp = 0;
+  spygc_execute(S);
+  push_root(S, build_tree(S, tree_node, TREE_DEPTH));
+  time_collection(S, "tree", ((size_t)1 << TREE_DEPTH) - 1);
+}
+
+/* arguments are the mark thread counts to try, by default one thread and
+ * one per processor */
+int main(int argc, char **argv) {
+  if (argc > 1) {
+    for (int i = 1; i < argc; i++) {
+      run((size_t)strtoull(argv[i], NULL, 10));
+    }
+  } else {
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    run(1);
+    if (ncpus > 1) {
+      run((size_t)ncpus);
+    }
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,64 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include "../src/memory.h"
+#include "bench.h"
+
+/* measures short-lived allocation on top of a large live heap.  a linked
+ * list of OLD_LENGTH nodes is built and rooted from the VM stack, then
+ * CHURN temporary structs are allocated and dropped.  run once with the
+ * default nursery, once with it disabled, where every collection is a
+ * full one, and once more without it but marking incrementally.
+ * allocations are timed in blocks of BLOCK, the slowest block stands in
+ * for the worst collection pause */
+
+#define OLD_LENGTH 1000000
+#define CHURN      20000000
+#define BLOCK      1000
+
+static void run(const char *name, size_t nursery_size, size_t slice_us) {
+  SpyreConfig_T config;
+  spyre_config_defaults(&config);
+  config.nursery_size = nursery_size;
+  config.gc_slice_us = slice_us;
+
+  SpyreState_T *S = spyre_init(&config);
+  SpyreInternalType_T *node = make_type(S, "Node", 1, 1);
+  SpyreInternalType_T *vec = make_type(S, "Vec", 0, 3);
+
+  /* the list head lives in the first stack slot so collections during
+   * the build see it */
+  size_t *root = (size_t *)&S->stack[0];
+  S->sp = sizeof(size_t);
+  *root = 0;
+  for (size_t i = 0; i < OLD_LENGTH; i++) {
+    size_t n = spymem_alloc(S, node->type_id);
+    ((size_t *)spymem_rawbuf(S, n))[0] = *root;
+    *root = n;
+  }
+
+  double worst = 0.0;
+  double start = now();
+  for (size_t i = 0; i < CHURN; i += BLOCK) {
+    double t = now();
+    for (size_t j = 0; j < BLOCK; j++) {
+      (void)spymem_alloc(S, vec->type_id);
+    }
+    t = now() - t;
+    if (t > worst) {
+      worst = t;
+    }
+  }
+  double elapsed = now() - start;
+
+  fprintf(stderr, "%-12s %d allocations in %.3fs  (%.1f M allocs/s), worst pause %.2f ms\n",
+          name, CHURN, elapsed, CHURN / elapsed / 1e6, worst * 1e3);
+}
+
+int main(void) {
+  run("nursery", 512 * 1024, 0);
+  run("full-only", 0, 0);
+  run("incremental", 0, 200);
+  return EXIT_SUCCESS;
+}
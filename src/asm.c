@@ -43,9 +43,8 @@ static const struct {
   {"FLAGS",   0x93, 0},
   {"ALLOC",   0xA0, 1},
   {"FREE",    0xA1, 0},
-  {"TAGL",    0xA2, 1},
-  {"UNTAGL",  0xA3, 1},
-  {"UNTAGLS", 0xA4, 1},
+  {"SMAP",    0xA5, 3},
+  {"ALLOCL",  0xA6, 2},
   {"ITEST",   0xC0, 0},
   {"ICMP",    0xC1, 0},
   {"FCMP",    0xC2, 0},
@@ -62,26 +61,32 @@ static const struct {
   {"CALL",    0xCD, 2},
   {"CCALL",   0xCE, 2},
   {"IRET",    0xCF, 0},
-  {"RET",     0xD0, 0}
+  {"RET",     0xD0, 0},
+  {"IJEQ",    0xD1, 1},
+  {"IJNEQ",   0xD2, 1},
+  {"IJLT",    0xD3, 1},
+  {"IJLE",    0xD4, 1},
+  {"IJGT",    0xD5, 1},
+  {"IJGE",    0xD6, 1}
 };
 
 static void advance(AssembleState_T *A, size_t n) {
   for (size_t i = 0; i < n && A->at != NULL; i++) {
-    A->at = A->at->next;
+    A->at = lex_next(A->L, A->at);
   }
 }
 
 static LexToken_T *peek(AssembleState_T *A, size_t n) {
   LexToken_T *t = A->at;
   for (size_t i = 0; i < n && t != NULL; i++) {
-    t = t->next;
+    t = lex_next(A->L, t);
   }
   return t;
 }
 
 static bool is_word(AssembleState_T *A, const char *word, LexToken_T *tok) {
   LexToken_T *check = tok != NULL ? tok : A->at;
-  return check != NULL && !strcmp(check->as_string, word);
+  return check != NULL && check->as_string != NULL && !strcmp(check->as_string, word);
 }
 
 static bool is_type(AssembleState_T *A, LexTokenType_T type, LexToken_T *tok) {
@@ -121,12 +126,11 @@ static void write_f64(AssembleState_T *A, double v) {
 }
 
 static void register_label(AssembleState_T *A) {
-  char *key = malloc(strlen(A->at->as_string) + 1);
+  const char *key = A->at->as_string;
   size_t *value = malloc(sizeof(size_t));
 
-  assert(key && value);
+  assert(value);
   
-  strcpy(key, A->at->as_string);
   advance(A, 1);
   *value = A->bufat;
   advance(A, 1);
@@ -139,9 +143,7 @@ static void register_label(AssembleState_T *A) {
 static void pend_label(AssembleState_T *A, const char *name) {
   PendingLabel_T *append = malloc(sizeof(PendingLabel_T));
   assert(append);
-  append->label_name = malloc(strlen(name) + 1);
-  assert(append->label_name);
-  strcpy(append->label_name, A->at->as_string);
+  append->label_name = name;
   append->bufaddr = A->bufat;
   if (A->pending) {
     append->next = A->pending;
@@ -167,7 +169,6 @@ static void write_pending_labels(AssembleState_T *A) {
       exit(EXIT_FAILURE);
     }
     *(size_t *)&A->writebuf[pending->bufaddr] = *label;
-    free(pending->label_name);
     free(pending);
   }
 }
@@ -208,7 +209,7 @@ static void read_instruction(AssembleState_T *A) {
             }
             break;
           default:
-            fprintf(stderr, "invalid operand '%s'\n", A->at->as_string);
+            fprintf(stderr, "invalid operand '%s'\n", lex_token_text(A->L, A->at));
             exit(EXIT_FAILURE);
         }
         advance(A, 1);
@@ -246,7 +247,7 @@ static AssembleState_T *asmstate_init(const char *infile, const char *outfile) {
     fprintf(stderr, "couldn't open '%s' for reading\n", outfile);
   }
   A->labels = hash_init();
-  A->at = A->L->tokens;
+  A->at = A->L->ntokens > 0 ? A->L->tokens : NULL;
   A->pending = NULL;
 
   A->writebuf = malloc(sizeof(uint8_t) * INITIAL_BUFFER_SIZE);
@@ -264,7 +265,7 @@ void assemble_file(const char *infile, const char *outfile) {
   while (A->at != NULL) {
     if (is_type(A, TOKEN_IDENTIFIER, NULL) && is_word(A, ":", peek(A, 1))) {
       register_label(A);
-    } else if (!strcmp(A->at->as_string, "db")) {
+    } else if (is_word(A, "db", NULL)) {
       read_db(A);
     } else {
       read_instruction(A);
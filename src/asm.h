@@ -6,7 +6,7 @@
 #include "hash.h"
 
 typedef struct PendingLabel {
-  char *label_name;
+  const char *label_name;  /* interned */
   size_t bufaddr;
   struct PendingLabel *next;
 } PendingLabel_T;
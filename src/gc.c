@@ -1,139 +1,463 @@
+#define _DEFAULT_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include "gc.h"
 #include "memory.h"
+#include "marker.h"
 
 /* this file contains all functions related to garbage collection.  It implements
- * the two main stages of garbage collection: mark and sweep */
+ * the two main stages of garbage collection: mark and sweep, and the minor
+ * collections that empty the nursery.  what each collection costs is kept
+ * in SpyreState_T.gc_stats.  build with -DDEBUG_GC to trace every segment
+ * marked, promoted and freed */
 
-static void domark(SpyreState_T *S, size_t seg_id) {
-	uint8_t *rawbuf;
-  uint8_t **allocs = S->memory->allocs;
-  MemoryDescriptor_T *mdesc = (MemoryDescriptor_T *)&allocs[seg_id][0];
-  SpyreInternalType_T *typeinfo = get_type(S, mdesc->type_name);
+#define GRAY_INITIAL_CAPACITY       256
+#define REMEMBERED_INITIAL_CAPACITY 64
+#define SLICE_INTERVAL              1024 /* allocations between mark slices */
+#define SLICE_INTERVAL_BEHIND       64   /* the same once the heap is over its threshold */
+#define SLICE_CLOCK_INTERVAL        64   /* segments scanned between clock reads */
+#define SWEEP_STEP_WORDS            16   /* mark_bits words per lazy sweep step */
+
+static double now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/* adds the time since START, in microseconds, to PHASE in milliseconds.
+ * every collector entry point holds the program up, so each is a pause */
+static void end_pause(SpyreState_T *S, double start, double *phase) {
+  double ms = (now_us() - start) / 1e3;
+  *phase += ms;
+  if (ms > S->gc_stats.max_pause_ms) {
+    S->gc_stats.max_pause_ms = ms;
+  }
+}
+
+/* marking is iterative.  a segment is marked when it is first found and
+ * its seg_id pushed onto the gray stack; popping it scans its members.
+ * the gray stack lives on the memory map and is reused between cycles,
+ * so deep structures cost heap space rather than C stack.  all roots are
+ * grayed before any are scanned, which lets a full collection hand them
+ * to the parallel markers in marker.c instead */
+static void gray_push(SpyreMemoryMap_T *memory, size_t seg_id) {
+  if (spymem_marked(memory, seg_id)) {
+    return;
+  }
+  spymem_set_mark(memory, seg_id, true);
+#ifdef DEBUG_GC
+  printf("marked seg_id %zu\n", seg_id);
+#endif
+
+  if (memory->ngray >= memory->gray_capacity) {
+    memory->gray_capacity = memory->gray_capacity > 0 
+                            ? memory->gray_capacity*2 : GRAY_INITIAL_CAPACITY;
+    memory->gray = realloc(memory->gray, sizeof(size_t) * memory->gray_capacity);
+    spyre_assert(memory->gray != NULL);
+  }
+  memory->gray[memory->ngray++] = seg_id;
+}
+
+/* does VALUE name a segment still in the nursery? */
+static bool is_young(SpyreMemoryMap_T *memory, size_t value) {
+  return value != 0 && value < memory->capacity && memory->allocs[value] != NULL
+         && (((MemoryDescriptor_T *)memory->allocs[value])->flags & MEM_YOUNG);
+}
+
+/* grays the segments SEG_ID refers to.  a minor collection only follows
+ * references into the nursery, a full one only those out of it */
+static void scan_members(SpyreState_T *S, size_t seg_id, bool minor) {
+  SpyreMemoryMap_T *memory = S->memory;
+  MemoryDescriptor_T *mdesc = (MemoryDescriptor_T *)memory->allocs[seg_id];
+  SpyreInternalType_T *typeinfo = S->types[mdesc->type_id];
   SpyreInternalMember_T *member;
-  SpyreInternalType_T *meminfo;
+  uint8_t *rawbuf = spymem_rawbuf(S, seg_id);
   size_t mem_seg_id;
 
-	/* base case */
-	if (mdesc->mark) {
-		return;
-	}
-  
-  mdesc->mark = true;
-  printf("marked seg_id %zu\n", seg_id);
-  
   for (size_t i = 0; i < typeinfo->nmembers; i++) {
-		rawbuf = spymem_rawbuf(S, seg_id);
     member = typeinfo->members[i];
-    meminfo = member->type;
-    if (meminfo->nmembers > 0) {
+    if (member->type->nmembers > 0) {
       mem_seg_id = *(size_t *)&rawbuf[member->byte_offset];
-      if (mem_seg_id != 0) {
-        domark(S, mem_seg_id);
+      if (mem_seg_id != 0 && is_young(memory, mem_seg_id) == minor) {
+        gray_push(memory, mem_seg_id);
       }
     }
   }
-  
 }
 
-/* iterate through all memory segments and unmark */
-static void unmark(SpyreState_T *S) {
-  size_t capacity = S->memory->capacity;
-  uint8_t **allocs = S->memory->allocs;
-  MemoryDescriptor_T *typeinfo;
-  for (size_t i = 0; i < capacity; i++) {
-    if (allocs[i] != NULL) {
-      typeinfo = (MemoryDescriptor_T *)&allocs[i][0]; 
-      if (typeinfo->mark) {
-        printf("unmarked seg_id %zu\n", i);
+/* scans gray segments until only BASE are left.  a minor collection can
+ * run while an incremental full one still has gray segments pending */
+static void drain(SpyreState_T *S, bool minor, size_t base) {
+  SpyreMemoryMap_T *memory = S->memory;
+  while (memory->ngray > base) {
+    scan_members(S, memory->gray[--memory->ngray], minor);
+  }
+}
+
+/* grays VALUE if it names an allocated segment.  slots that the stack
+ * maps call references can still hold a stale integer when a block reuses
+ * another block's slot, so every candidate is checked */
+static void mark_word(SpyreState_T *S, size_t value, bool minor) {
+  if (value != 0 && value < S->memory->capacity && S->memory->allocs[value] != NULL
+      && is_young(S->memory, value) == minor) {
+    gray_push(S->memory, value);
+  }
+}
+
+static const SpyreStackMap_T *find_stackmap(SpyreState_T *S, const SpyreCell_T *cell) {
+  size_t index = (size_t)(cell - S->cells);
+  size_t lo = 0;
+  size_t hi = S->nstackmaps;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo)/2;
+    if (S->stackmaps[mid].cell < index) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo < S->nstackmaps && S->stackmaps[lo].cell == index ? &S->stackmaps[lo] : NULL;
+}
+
+/* walks the VM frames from the innermost out.  a frame's locals are
+ * marked precisely from the stack map of the safepoint it is stopped at:
+ * the current instruction for the innermost frame, the CALL before the
+ * saved return address for the others.  the operand stack above the
+ * locals is scanned conservatively, as are frames without a map (the
+ * entry frame and hand-written bytecode).
+ *
+ *   bp - 24  number of args
+ *   bp - 16  caller's bp
+ *   bp - 8   return address */
+static void mark(SpyreState_T *S, bool minor) {
+  uint8_t *stack = S->stack;
+  size_t bp = S->bp;
+  size_t limit = S->sp;
+  const SpyreCell_T *at = S->ip;
+  const SpyreStackMap_T *map;
+  size_t precise;
+
+  for (;;) {
+    map = at != NULL ? find_stackmap(S, at) : NULL;
+    precise = 0;
+    if (map != NULL) {
+      const uint32_t *refs = &S->stackmap_words[map->refs];
+      for (size_t slot = 0; slot < map->nlocals; slot++) {
+        if (refs[slot/32] & (UINT32_C(1) << (slot%32))) {
+          mark_word(S, *(size_t *)&stack[bp + slot*sizeof(size_t)], minor);
+        }
       }
-      typeinfo->mark = false;
+      precise = map->nlocals;
+    }
+    for (size_t a = bp + precise*sizeof(size_t); a + sizeof(size_t) <= limit; 
+         a += sizeof(size_t)) {
+      mark_word(S, *(size_t *)&stack[a], minor);
     }
+
+    if (bp == 0) {
+      break;
+    }
+    at = *(const SpyreCell_T **)&stack[bp - 8] - 1;
+    limit = bp - 24;
+    bp = *(size_t *)&stack[bp - 16];
   }
 }
 
-static void mark(SpyreState_T *S) {
-  SpyreAddressList_T *addr;
-  for (addr = S->memory->localtags; addr != NULL; addr = addr->next) {
-    size_t seg_id = spyre_local_asptr(S, addr->addr); 
-    domark(S, seg_id);
+/* sweeping.  a cycle ends with its marks still set, and the garbage is
+ * freed lazily: spymem_alloc sweeps a few words of the bitmaps whenever
+ * an old allocation finds no freed cell to reuse.  a sweep step frees the
+ * unmarked segments of 64 seg_ids at a time and unmarks the rest, so the
+ * headers of survivors are never touched, and once the sweep is done no
+ * segment is marked.  young segments were not traced by the cycle and
+ * are left to minor collections */
+static void sweep_word(SpyreState_T *S, size_t w) {
+  SpyreMemoryMap_T *memory = S->memory;
+  uint64_t dead = memory->live_bits[w] & ~memory->mark_bits[w];
+  size_t live_bytes = memory->live_bytes;
+  size_t i;
+
+  while (dead != 0) {
+    i = w*64 + (size_t)__builtin_ctzll(dead);
+    dead &= dead - 1;
+    if (((MemoryDescriptor_T *)memory->allocs[i])->flags & MEM_YOUNG) {
+      continue;
+    }
+    spymem_free(S, i);
+    S->gc_stats.current.freed_objects++;
+#ifdef DEBUG_GC
+    printf("freed seg_id %zu\n", i);
+#endif
   }
+  memory->mark_bits[w] = 0;
+  memory->swept_bytes -= live_bytes - memory->live_bytes;
+  S->gc_stats.current.freed_bytes += live_bytes - memory->live_bytes;
 }
 
-static void sweep(SpyreState_T *S) {
-  size_t capacity = S->memory->capacity;
-  uint8_t **allocs = S->memory->allocs;
-  MemoryDescriptor_T *typeinfo;
-  for (size_t i = 0; i < capacity; i++) {
-    if (allocs[i] != NULL) {
-      typeinfo = (MemoryDescriptor_T *)&allocs[i][0]; 
-      if (!typeinfo->mark) {
-        spymem_free(S, i);
-        printf("freed seg_id %zu\n", i);
-      }
+/* sweeps whatever the last cycle left, then sets the next threshold from
+ * what survived it and gives memory back.  segments allocated since the
+ * cycle are not counted as survivors, or a lazy sweep would inflate the
+ * threshold by everything the program allocated while it ran */
+static void finish_sweep(SpyreState_T *S) {
+  SpyreMemoryMap_T *memory = S->memory;
+  SpyreGCStats_T *stats = &S->gc_stats;
+  double start = now_us();
+
+  while (memory->sweep_cursor < memory->sweep_end) {
+    sweep_word(S, memory->sweep_cursor++);
+  }
+  memory->sweeping = false;
+
+  /* let the heap grow in proportion to what survived */
+  size_t target = (size_t)(memory->swept_bytes * S->config.heap_growth);
+  memory->gc_threshold = target > S->config.heap_initial 
+                         ? target : S->config.heap_initial;
+
+  spymem_compact(S);
+  end_pause(S, start, &stats->current.sweep_ms);
+
+  /* the cycle is over */
+  stats->current.live_bytes = memory->live_bytes;
+  stats->cycles++;
+  stats->mark_pause_ms += stats->current.mark_pause_ms;
+  stats->mark_slices_ms += stats->current.mark_slices_ms;
+  stats->sweep_ms += stats->current.sweep_ms;
+  stats->freed_objects += stats->current.freed_objects;
+  stats->freed_bytes += stats->current.freed_bytes;
+  if (S->config.gc_callback != NULL) {
+    S->config.gc_callback(S, &stats->current, S->config.gc_callback_data);
+  }
+}
+
+void spygc_sweep_step(SpyreState_T *S) {
+  SpyreMemoryMap_T *memory = S->memory;
+  double start = now_us();
+  for (size_t i = 0; i < SWEEP_STEP_WORDS && memory->sweep_cursor < memory->sweep_end; i++) {
+    sweep_word(S, memory->sweep_cursor++);
+  }
+  end_pause(S, start, &S->gc_stats.current.sweep_ms);
+  if (memory->sweep_cursor == memory->sweep_end) {
+    finish_sweep(S);
+  }
+}
+
+/* minor collection.  the roots are the VM stack and the remembered set;
+ * old segments are never traced, so the work follows the live young data
+ * rather than the size of the heap.  survivors are promoted and the
+ * nursery is then empty, which also leaves no old-to-young references
+ * for the remembered set to track */
+static void collect_young(SpyreState_T *S) {
+  SpyreMemoryMap_T *memory = S->memory;
+  MemoryDescriptor_T *mdesc;
+  size_t seg_id;
+  size_t base = memory->ngray;
+  size_t live_bytes = memory->live_bytes;
+  double start = now_us();
+
+  mark(S, true);
+  for (size_t i = 0; i < memory->nremembered; i++) {
+    seg_id = memory->remembered[i];
+    mdesc = (MemoryDescriptor_T *)memory->allocs[seg_id];
+    /* freed, or freed and reused, since it was remembered */
+    if (mdesc == NULL || !(mdesc->flags & MEM_REMEMBERED)) {
+      continue;
     }
+    mdesc->flags &= ~MEM_REMEMBERED;
+    scan_members(S, seg_id, true);
   }
+  drain(S, true, base);
+
+  /* a seg_id can appear twice if it was freed and reused while young,
+   * its first entry handles it */
+  for (size_t i = 0; i < memory->nyoung; i++) {
+    seg_id = memory->young[i];
+    mdesc = (MemoryDescriptor_T *)memory->allocs[seg_id];
+    if (mdesc == NULL || !(mdesc->flags & MEM_YOUNG)) {
+      continue;
+    }
+    if (spymem_marked(memory, seg_id)) {
+      spymem_promote(S, seg_id);
+#ifdef DEBUG_GC
+      printf("promoted seg_id %zu\n", seg_id);
+#endif
+    } else {
+      spymem_free(S, seg_id);
+      S->gc_stats.minor_freed_objects++;
+#ifdef DEBUG_GC
+      printf("freed young seg_id %zu\n", seg_id);
+#endif
+    }
+  }
+
+  /* survivors were copied out at the same size, the rest of the nursery
+   * was garbage */
+  S->gc_stats.minor_freed_bytes += (size_t)(memory->nursery_top - memory->nursery)
+                                   - (memory->live_bytes - live_bytes);
+  memory->nyoung = 0;
+  memory->nremembered = 0;
+  memory->nursery_top = memory->nursery;
+  S->gc_stats.minor_cycles++;
+  end_pause(S, start, &S->gc_stats.minor_ms);
 }
 
-void spygc_execute(SpyreState_T *S) {
-  printf("******** GC RUNNING ********\n");
-  printf("==== UNMARKING ====\n");
-  unmark(S);
-  printf("===================\n\n");
-  printf("==== MARKING ====\n");
-  mark(S);
-  printf("=================\n\n");
-  printf("==== SWEEPING ====\n");
-  sweep(S);
-  printf("==================\n");
-  printf("****************************\n\n");
-}
-
-void spygc_track_local(SpyreState_T *S, size_t local_index) {
-  size_t stack_addr = S->bp + local_index;
-  SpyreAddressList_T *localtag = malloc(sizeof(SpyreAddressList_T));
-  spyre_assert(localtag != NULL);
-  localtag->addr = stack_addr;
-
-  /* append to root node list */
-  if (S->memory->localtags != NULL) {
-    localtag->next = S->memory->localtags;
-    S->memory->localtags = localtag;
+/* called when the nursery is full.  promotion grows the old space, so
+ * this may go on to a full collection */
+void spygc_minor(SpyreState_T *S) {
+  collect_young(S);
+  if (S->memory->live_bytes >= S->memory->gc_threshold) {
+    spygc_collect(S);
+  }
+}
+
+/* write barrier slow path.  SEG_ID is an old segment that just had a
+ * young seg_id stored into it */
+void spygc_remember(SpyreState_T *S, size_t seg_id) {
+  SpyreMemoryMap_T *memory = S->memory;
+  MemoryDescriptor_T *mdesc = (MemoryDescriptor_T *)memory->allocs[seg_id];
+
+  mdesc->flags |= MEM_REMEMBERED;
+  if (memory->nremembered >= memory->remembered_capacity) {
+    memory->remembered_capacity = memory->remembered_capacity > 0
+                                  ? memory->remembered_capacity*2 
+                                  : REMEMBERED_INITIAL_CAPACITY;
+    memory->remembered = realloc(memory->remembered, 
+                                 sizeof(uint32_t) * memory->remembered_capacity);
+    spyre_assert(memory->remembered != NULL);
+  }
+  memory->remembered[memory->nremembered++] = (uint32_t)seg_id;
+}
+
+/* full collections.  a cycle starts by emptying the nursery and graying
+ * the roots, and ends by draining the gray stack and sweeping.  with
+ * gc_slice_us set the draining in between is done a slice at a time from
+ * spymem_alloc, and the program runs between slices.
+ *
+ * the mark is a snapshot at the beginning: everything reachable when the
+ * cycle starts is marked, and everything allocated or promoted during it
+ * is born marked.  the one way the program can hide a snapshot segment
+ * from the marker is to overwrite the only reference to it, so SVMBR
+ * grays the value it replaces (spygc_shade).  the stack needs no barrier,
+ * it was scanned whole when the cycle began */
+static void start_cycle(SpyreState_T *S) {
+  SpyreGCStats_T *stats = &S->gc_stats;
+  double start;
+
+  if (S->memory->sweeping) {
+    finish_sweep(S);
+  }
+  memset(&stats->current, 0, sizeof(stats->current));
+  stats->current.cycle = stats->cycles + 1;
+
+  start = now_us();
+  collect_young(S);
+  mark(S, false);
+  S->memory->marking = true;
+  S->memory->slice_countdown = SLICE_INTERVAL;
+  end_pause(S, start, &stats->current.mark_pause_ms);
+}
+
+static void finish_cycle(SpyreState_T *S) {
+  double start = now_us();
+
+  /* young segments were never traced by this cycle.  promoting the live
+   * ones now marks them, the rest are freed */
+  collect_young(S);
+
+  if (S->marker != NULL) {
+    spymark_drain(S);
   } else {
-    S->memory->localtags = localtag;
-    localtag->next = NULL;
-  }
-}
-
-/* untags one local variable */
-void spygc_untrack_local(SpyreState_T *S, size_t local_index) {
-	SpyreAddressList_T *prev = NULL;
-	for (SpyreAddressList_T *a = S->memory->localtags; a != NULL; a = a->next) {
-		if (a->addr == local_index) {
-			if (prev != NULL) {
-				prev->next = a->next;
-			} else {
-				S->memory->localtags = a->next;
-			}
-			free(a);
-			break;
-		}
-		prev = a;
-	}
-}
-
-/* untags local variables from root node stack */
-void spygc_untrack_locals(SpyreState_T *S, size_t num_locals) {
-  SpyreAddressList_T *pop;
-  for (size_t i = 0; i < num_locals; i++) {
-    if (!S->memory->localtags) {
-      fprintf(stderr, "garbage collection mismatch\n");
-      exit(EXIT_FAILURE);
+    drain(S, false, 0);
+  }
+  S->memory->marking = false;
+
+  /* until the sweep is done live_bytes still counts the garbage.  the
+   * threshold is set as if all of it survived, and set properly once the
+   * sweep knows better */
+  S->memory->sweeping = true;
+  S->memory->sweep_cursor = 0;
+  S->memory->sweep_end = (S->memory->index + 63) / 64;
+  S->memory->swept_bytes = S->memory->live_bytes;
+  size_t target = (size_t)(S->memory->live_bytes * S->config.heap_growth);
+  S->memory->gc_threshold = target > S->config.heap_initial 
+                            ? target : S->config.heap_initial;
+  end_pause(S, start, &S->gc_stats.current.mark_pause_ms);
+}
+
+/* called when the old space reaches its threshold.  a pending sweep is
+ * finished first, and may bring the heap back under.  otherwise starts an
+ * incremental cycle, or marks on the spot if slicing is off.  a cycle
+ * already under way is falling behind the program: its slices come more
+ * often, and once the heap has grown by another heap_growth it is
+ * finished on the spot, so the heap cannot outgrow the marker */
+void spygc_collect(SpyreState_T *S) {
+  SpyreMemoryMap_T *memory = S->memory;
+
+  if (memory->sweeping) {
+    finish_sweep(S);
+    if (memory->live_bytes < memory->gc_threshold) {
+      return;
     }
-    pop = S->memory->localtags;
-    S->memory->localtags = pop->next;
-    free(pop);
+  }
+  if (S->config.gc_slice_us == 0) {
+    start_cycle(S);
+    finish_cycle(S);
+  } else if (!memory->marking) {
+    start_cycle(S);
+  } else if (memory->live_bytes >= (size_t)(memory->gc_threshold * S->config.heap_growth)) {
+    finish_cycle(S);
+  } else if (memory->slice_countdown > SLICE_INTERVAL_BEHIND) {
+    memory->slice_countdown = SLICE_INTERVAL_BEHIND;
   }
 }
 
+/* runs one mark slice of at most gc_slice_us, finishing the cycle once
+ * nothing is left gray */
+void spygc_step(SpyreState_T *S) {
+  SpyreMemoryMap_T *memory = S->memory;
+  double start = now_us();
+  double deadline = start + S->config.gc_slice_us;
+
+  memory->slice_countdown = SLICE_INTERVAL;
+  while (memory->ngray > 0) {
+    for (size_t i = 0; i < SLICE_CLOCK_INTERVAL && memory->ngray > 0; i++) {
+      scan_members(S, memory->gray[--memory->ngray], false);
+    }
+    if (now_us() >= deadline) {
+      end_pause(S, start, &S->gc_stats.current.mark_slices_ms);
+      return;
+    }
+  }
+  end_pause(S, start, &S->gc_stats.current.mark_slices_ms);
+  finish_cycle(S);
+}
+
+/* snapshot barrier slow path.  VALUE is about to be overwritten in a
+ * segment while a cycle is marking */
+void spygc_shade(SpyreState_T *S, size_t value) {
+  mark_word(S, value, false);
+}
+
+/* collects the whole heap now, finishing any cycle in progress, and
+ * sweeps without waiting for allocations */
+void spygc_execute(SpyreState_T *S) {
+  if (!S->memory->marking) {
+    start_cycle(S);
+  }
+  finish_cycle(S);
+  finish_sweep(S);
+}
+
+/* writes a summary of gc_stats to OUT */
+void spygc_report(SpyreState_T *S, FILE *out) {
+  SpyreGCStats_T *stats = &S->gc_stats;
+  fprintf(out, "gc: %zu full collections, %zu minor\n", stats->cycles, stats->minor_cycles);
+  fprintf(out, "gc: mark %.2f ms paused + %.2f ms in slices, sweep %.2f ms, minor %.2f ms\n",
+          stats->mark_pause_ms, stats->mark_slices_ms, stats->sweep_ms, stats->minor_ms);
+  fprintf(out, "gc: longest pause %.2f ms\n", stats->max_pause_ms);
+  fprintf(out, "gc: freed %zu objects, %zu bytes in full collections, %zu objects, %zu bytes in minor\n",
+          stats->freed_objects, stats->freed_bytes,
+          stats->minor_freed_objects, stats->minor_freed_bytes);
+  fprintf(out, "gc: %zu bytes live after the last collection, peak %zu\n",
+          stats->current.live_bytes, stats->peak_bytes);
+}
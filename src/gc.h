@@ -1,11 +1,16 @@
 #ifndef GC_H
 #define GC_H
 
+#include <stdio.h>
 #include "spyre.h"
 
 void spygc_execute(SpyreState_T *S);
-void spygc_track_local(SpyreState_T *S, size_t local_index);
-void spygc_untrack_locals(SpyreState_T *S, size_t num_locals);
-void spygc_untrack_local(SpyreState_T *S, size_t local_index);
+void spygc_collect(SpyreState_T *S);
+void spygc_step(SpyreState_T *S);
+void spygc_sweep_step(SpyreState_T *S);
+void spygc_minor(SpyreState_T *S);
+void spygc_remember(SpyreState_T *S, size_t seg_id);
+void spygc_shade(SpyreState_T *S, size_t value);
+void spygc_report(SpyreState_T *S, FILE *out);
 
 #endif
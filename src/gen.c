@@ -2,6 +2,7 @@
 #include <stdio.h>
 #include <assert.h>
 #include <string.h>
+#include <inttypes.h>
 #include "gen.h"
 
 /* syntax generation */
@@ -10,6 +11,7 @@ static void generate_block(GenerateState_T *, ASTNode_T **);
 static void generate_if(GenerateState_T *, ASTNode_T **);
 static void generate_while(GenerateState_T *, ASTNode_T **);
 static void generate_return(GenerateState_T *, ASTNode_T **);
+static void generate_branch_if_false(GenerateState_T *, NodeExpression_T *, size_t);
 
 /* expression generation */
 static void generate_type_db(GenerateState_T *G, const Datatype_T *);
@@ -21,19 +23,164 @@ static void generate_assignment(GenerateState_T *G, BinaryOpNode_T *);
 static void generate_member_index(GenerateState_T *G, BinaryOpNode_T *);
 static void generate_call(GenerateState_T *G, CallNode_T *);
 
+static Declaration_T *get_local(ASTNode_T *, const char *);
+
+/* escape analysis.  an object that never outlives its function can be
+ * kept in the function's frame: each member gets a local slot, `new`
+ * zeroes those slots (ALLOCL) instead of calling spymem_alloc, and member
+ * accesses become plain local loads and stores, so the GC never sees it.
+ * a struct local qualifies when every use of it is one of
+ *
+ *   x = new T;   as a statement of its own
+ *   x.m          read, or assigned to
+ *
+ * anything else lets the object escape: passing x to a function,
+ * returning it, storing it in a member or another variable, comparing it.
+ * arguments never qualify, their objects belong to the caller.
+ * identifiers are resolved with get_local, exactly as they will be when
+ * the code is generated */
+
+/* does a variable of type DT hold a single struct, rather than an array
+ * or pointer of them? */
+static bool is_struct_object(const Datatype_T *dt) {
+  return dt->type == DT_STRUCT && dt->ptrdim == 0 && dt->arrdim == 0;
+}
+
+/* is EXP, naming the struct local DECL, one of the uses above? */
+static bool is_frame_use(const Declaration_T *decl, const NodeExpression_T *exp) {
+  const NodeExpression_T *parent = exp->parent;
+  if (parent == NULL || parent->type != EXP_BINARY || exp->leaf != LEAF_LEFT) {
+    return false;
+  }
+  switch (parent->binop->optype) {
+    case '.':
+      return hash_get(decl->dt->sdesc->members, parent->binop->right_operand->identval) != NULL;
+    case '=':
+      return parent->parent == NULL 
+             && parent->binop->right_operand->type == EXP_NEW
+             && parent->binop->right_operand->newop->arrdim == 0;
+    default:
+      return false;
+  }
+}
+
+static void escape_expression(GenerateState_T *G, NodeExpression_T *exp) {
+  Declaration_T *decl;
+
+  if (exp == NULL) {
+    return;
+  }
+
+  switch (exp->type) {
+    case EXP_IDENTIFIER:
+      /* the member name of x.m is not a variable */
+      if (exp->parent != NULL && exp->parent->type == EXP_BINARY 
+          && exp->parent->binop->optype == '.' && exp->leaf == LEAF_RIGHT) {
+        break;
+      }
+      decl = get_local(G->at, exp->identval);
+      if (decl != NULL && decl->in_frame && !is_frame_use(decl, exp)) {
+        decl->in_frame = false;
+      }
+      break;
+    case EXP_BINARY:
+      escape_expression(G, exp->binop->left_operand);
+      escape_expression(G, exp->binop->right_operand);
+      break;
+    case EXP_UNARY:
+      escape_expression(G, exp->unop->operand);
+      break;
+    case EXP_INDEX:
+      escape_expression(G, exp->inop->array);
+      escape_expression(G, exp->inop->index);
+      break;
+    case EXP_CALL:
+      escape_expression(G, exp->callop->func);
+      escape_expression(G, exp->callop->args);
+      break;
+    case EXP_NEW:
+      for (NodeExpression_T *dim = exp->newop->arrsize; dim != NULL; dim = dim->next) {
+        escape_expression(G, dim);
+      }
+      break;
+    default:
+      break;
+  }
+}
+
+/* first pass: every struct local is a candidate, unless another variable
+ * of the same name shadows it for get_local.  the second pass, over the
+ * expressions, rules out the ones that escape */
+static void find_frame_candidates(GenerateState_T *G, ASTNode_T *node) {
+  for (; node != NULL; node = node->next) {
+    if (node->type == NODE_FUNCTION) {
+      for (Declaration_T *arg = node->nodefunc->args; arg != NULL; arg = arg->next) {
+        arg->in_frame = false;
+      }
+    } else if (node->type == NODE_BLOCK) {
+      for (Declaration_T *var = node->nodeblock->vars; var != NULL; var = var->next) {
+        var->in_frame = is_struct_object(var->dt) && get_local(G->at, var->name) == var;
+      }
+      find_frame_candidates(G, node->nodeblock->children);
+    }
+  }
+}
+
+static void find_escapes(GenerateState_T *G, ASTNode_T *node) {
+  for (; node != NULL; node = node->next) {
+    switch (node->type) {
+      case NODE_BLOCK:
+        find_escapes(G, node->nodeblock->children);
+        break;
+      case NODE_EXPRESSION:
+        escape_expression(G, node->nodeexp);
+        break;
+      case NODE_IF:
+        escape_expression(G, node->nodeif->cond);
+        break;
+      case NODE_WHILE:
+        escape_expression(G, node->nodewhile->cond);
+        break;
+      case NODE_FOR:
+        escape_expression(G, node->nodefor->init);
+        escape_expression(G, node->nodefor->cond);
+        escape_expression(G, node->nodefor->incr);
+        break;
+      case NODE_RETURN:
+        escape_expression(G, node->noderet->retval);
+        break;
+      default:
+        break;
+    }
+  }
+}
+
+static void analyze_escapes(GenerateState_T *G) {
+  find_frame_candidates(G, G->P->root);
+  find_escapes(G, G->P->root);
+}
+
+/* local slots taken by VAR.  a struct kept in the frame takes one per
+ * member, starting at its local_index */
+static size_t local_slots(const Declaration_T *var) {
+  return var->in_frame ? var->dt->sdesc->members->size : 1;
+}
+
 /* helper function for determine_local_indices.  recursively determines the local index
  * of function arguments, as well as local variables inside of blocks. 
- * returns the total number of stack space needed for a give node.  for example, when
- * called on a NODE_FUNCTION, returns the size of the stack that should be allocated
- * when the procedure is called */
+ * returns the number of stack slots needed for a give node.  for example, when
+ * called on a NODE_FUNCTION, returns the number of slots that should be reserved
+ * when the procedure is called.  local indices are slot numbers, the VM scales
+ * them by the word size */
 static size_t assign_local_indices(GenerateState_T *G, ASTNode_T *node, size_t start) {
   ASTNode_T *next = node->next;
   size_t local_index = start;
+  size_t needed;
   if (node->type == NODE_FUNCTION) {
     for (Declaration_T *arg = node->nodefunc->args; arg != NULL; arg = arg->next) {
       printf("assign %s %zu\n", arg->name, local_index);
       arg->local_index = local_index;
-      local_index += 8; /* TODO carefully evaluate */
+      local_index++;
     }
     if (next != NULL && next->type == NODE_BLOCK) {
       node->nodefunc->stack_space = assign_local_indices(G, next, local_index);
@@ -42,15 +189,23 @@ static size_t assign_local_indices(GenerateState_T *G, ASTNode_T *node, size_t s
     }
   } else if (node->type == NODE_BLOCK) {
     for (Declaration_T *var = node->nodeblock->vars; var != NULL; var = var->next) {
-      printf("assign %s %zu\n", var->name, local_index);
+      printf("assign %s %zu%s\n", var->name, local_index, var->in_frame ? " (in frame)" : "");
       var->local_index = local_index;
-      local_index += 8;
+      local_index += local_slots(var);
     }
+
+    /* nested blocks stack their variables on top of ours, the deepest
+     * one decides how much space we need */
+    needed = local_index;
     for (ASTNode_T *c = node->nodeblock->children; c != NULL; c = c->next) {
       if (c->type == NODE_BLOCK) {
-        assign_local_indices(G, c, local_index);
+        size_t inner = assign_local_indices(G, c, local_index);
+        if (inner > needed) {
+          needed = inner;
+        }
       }
     }
+    return needed;
   }
   return local_index;
 }
@@ -72,14 +227,15 @@ static NodeFunction_T *get_function(GenerateState_T *G, const char *ident) {
   return hash_get(G->P->functions, ident);
 }
 
-/* attempts to find a local variable in the current generation context */
+/* attempts to find a local variable in the current generation context.
+ * IDENT is a symbol, see intern.h */
 static Declaration_T *get_local(ASTNode_T *ast, const char *ident) {
   
   switch (ast->type) {
     case NODE_FUNCTION: {
       Declaration_T *arg = ast->nodefunc->args;
       for (; arg != NULL; arg = arg->next) {
-	if (!strcmp(arg->name, ident)) {
+	if (arg->name == ident) {
 	  return arg;
 	}
       }
@@ -88,7 +244,7 @@ static Declaration_T *get_local(ASTNode_T *ast, const char *ident) {
     case NODE_BLOCK: {
       Declaration_T *decl = ast->nodeblock->vars;
       for (; decl != NULL; decl = decl->next) {
-	if (!strcmp(decl->name, ident)) {
+	if (decl->name == ident) {
 	  return decl;
 	}
       }
@@ -150,6 +306,64 @@ static void generate_cfunc_db_map(const char *key, void *value, void *cl) {
   generate_cfunc_db((GenerateState_T *)cl, (const Declaration_T *)value);
 }
 
+/* does a variable of type DT hold a seg_id? */
+static bool is_reference(const Datatype_T *dt) {
+  return dt->type == DT_STRUCT || dt->ptrdim > 0 || dt->arrdim > 0;
+}
+
+typedef struct RefSlots {
+  GenerateState_T *G;
+  size_t base;
+  bool live;
+} RefSlots_T;
+
+static void set_member_refslot(const char *key, void *value, void *cl) {
+  Declaration_T *member = value;
+  RefSlots_T *slots = cl;
+  if (is_reference(member->dt)) {
+    slots->G->refslots[slots->base + member->struct_index] = slots->live;
+  }
+}
+
+/* marks or unmarks the reference-typed variables in DECLS as live in the
+ * current function's stack maps.  for a struct kept in the frame, those
+ * are its reference-typed members */
+static void set_refslots(GenerateState_T *G, Declaration_T *decls, bool live) {
+  if (G->refslots == NULL) {
+    return;
+  }
+  for (Declaration_T *d = decls; d != NULL; d = d->next) {
+    if (d->in_frame) {
+      RefSlots_T slots = {G, d->local_index, live};
+      hash_foreach(d->dt->sdesc->members, set_member_refslot, &slots);
+    } else if (is_reference(d->dt)) {
+      G->refslots[d->local_index] = live;
+    }
+  }
+}
+
+/* emits the stack map for the safepoint (ALLOC, CALL, CCALL) that follows.
+ * the GC may run there, and uses the map to find the locals holding
+ * references.  one SMAP per 32 slots that contain any */
+static void generate_stackmap(GenerateState_T *G) {
+  size_t nwords = (G->nlocals + 31) / 32;
+  if (G->refslots == NULL) {
+    return;
+  }
+  for (size_t word = 0; word < (nwords > 0 ? nwords : 1); word++) {
+    uint32_t bits = 0;
+    for (size_t i = 0; i < 32 && word*32 + i < G->nlocals; i++) {
+      if (G->refslots[word*32 + i]) {
+        bits |= UINT32_C(1) << i;
+      }
+    }
+    if (bits == 0 && word > 0) {
+      continue;
+    }
+    fprintf(G->outfile, "SMAP %zu %zu %" PRIu32 "\n", G->nlocals, word, bits);
+  }
+}
+
 static void generate_function(GenerateState_T *G, ASTNode_T **funcp) {
 
   ASTNode_T *func = *funcp;
@@ -164,9 +378,14 @@ static void generate_function(GenerateState_T *G, ASTNode_T **funcp) {
 
   /* reserve local space */
   write_s(G, "RESL ");
-  write_int(G, func->nodefunc->stack_space/8);
+  write_int(G, func->nodefunc->stack_space);
   write_s(G, "\n");
 
+  G->nlocals = func->nodefunc->stack_space;
+  G->refslots = calloc(G->nlocals > 0 ? G->nlocals : 1, sizeof(bool));
+  assert(G->refslots != NULL);
+  set_refslots(G, funcnode->args, true);
+
   /* load arguments onto stack and save as locals */
   for (Declaration_T *arg = funcnode->args; arg != NULL; arg = arg->next) {
     write_s(G, "ARG ");
@@ -187,6 +406,56 @@ static void generate_function(GenerateState_T *G, ASTNode_T **funcp) {
 
   write_s(G, "RET\n");
   *funcp = (*funcp)->next;
+
+  free(G->refslots);
+  G->refslots = NULL;
+  G->nlocals = 0;
+}
+
+/* returns the fused compare-and-branch instruction that jumps when the
+ * comparison OPTYPE is false, or NULL if OPTYPE isn't a comparison */
+static const char *inverse_branch(uint8_t optype) {
+  switch (optype) {
+    case SPECO_EQ:
+      return "IJNEQ";
+    case SPECO_NEQ:
+      return "IJEQ";
+    case SPECO_LE:
+      return "IJGT";
+    case SPECO_GE:
+      return "IJLT";
+    case '<':
+      return "IJGE";
+    case '>':
+      return "IJLE";
+    default:
+      return NULL;
+  }
+}
+
+/* emits a jump to LABEL that is taken when COND evaluates to false.  when
+ * COND is a comparison its operands feed a single fused compare-and-branch
+ * instead of ICMP, a flag push, ITEST and JZ */
+static void generate_branch_if_false(GenerateState_T *G, NodeExpression_T *cond, size_t label) {
+  const char *branch = NULL;
+
+  if (cond->type == EXP_BINARY) {
+    branch = inverse_branch(cond->binop->optype);
+  }
+
+  if (branch != NULL) {
+    generate_expression(G, cond->binop->left_operand);
+    generate_expression(G, cond->binop->right_operand);
+    write_s(G, branch);
+    write_s(G, " ");
+  } else {
+    generate_expression(G, cond);
+    write_s(G, "ITEST\n");
+    write_s(G, "JZ ");
+  }
+
+  write_label_ref(G, label);
+  write_s(G, "\n");
 }
 
 static void generate_while(GenerateState_T *G, ASTNode_T **whilep) {
@@ -196,11 +465,7 @@ static void generate_while(GenerateState_T *G, ASTNode_T **whilep) {
   ASTNode_T **next = &node->next;
   write_label(G, top_label);
   write_s(G, "\n");
-  generate_expression(G, node->nodewhile->cond);
-  write_s(G, "ITEST\n");
-  write_s(G, "JZ ");
-  write_label_ref(G, bot_label);
-  write_s(G, "\n");
+  generate_branch_if_false(G, node->nodewhile->cond, bot_label);
   generate_block(G, next);
   write_s(G, "JMP ");
   write_label_ref(G, top_label);
@@ -220,11 +485,7 @@ static void generate_for(GenerateState_T *G, ASTNode_T **forp) {
   }
   write_label(G, top_label);
   write_s(G, "\n");
-  generate_expression(G, node->nodefor->cond);
-  write_s(G, "ITEST\n");
-  write_s(G, "JZ ");
-  write_label_ref(G, bot_label);
-  write_s(G, "\n");
+  generate_branch_if_false(G, node->nodefor->cond, bot_label);
   generate_block(G, next);
   if (node->nodefor->incr) {
     generate_expression(G, node->nodefor->incr);
@@ -241,11 +502,7 @@ static void generate_if(GenerateState_T *G, ASTNode_T **ifp) {
   size_t neglbl = G->lcount++;
   ASTNode_T *ifnode = *ifp;
   ASTNode_T **next = &ifnode->next;
-  generate_expression(G, ifnode->nodeif->cond);
-  write_s(G, "ITEST\n");
-  write_s(G, "JZ ");
-  write_label_ref(G, neglbl);
-  write_s(G, "\n");
+  generate_branch_if_false(G, ifnode->nodeif->cond, neglbl);
   generate_block(G, next);
   write_label(G, neglbl);
   write_s(G, "\n");
@@ -270,13 +527,35 @@ static void generate_integer_expression(GenerateState_T *G, int64_t value) {
   write_s(G, "\n");
 }
 
+/* the struct kept in the frame that EXP names, or NULL if EXP is not a
+ * variable or its object lives on the heap */
+static Declaration_T *frame_object(GenerateState_T *G, const NodeExpression_T *exp) {
+  Declaration_T *decl;
+  if (exp->type != EXP_IDENTIFIER) {
+    return NULL;
+  }
+  decl = get_local(G->at, exp->identval);
+  return decl != NULL && decl->in_frame ? decl : NULL;
+}
+
+/* local slot of the member named by the '.' expression EXP, whose left
+ * operand is the frame object OBJ */
+static size_t frame_member_slot(const Declaration_T *obj, const BinaryOpNode_T *exp) {
+  Declaration_T *member = hash_get(obj->dt->sdesc->members, exp->right_operand->identval);
+  assert(member != NULL);
+  return obj->local_index + member->struct_index;
+}
+
 /* handles the binary operator '=' */
 static void generate_assignment(GenerateState_T *G, BinaryOpNode_T *exp) {
   
   bool is_struct_lhs = exp->left_operand->type == EXP_BINARY &&
                        exp->left_operand->binop->optype == '.';
 
-  if (exp->left_operand->binop->optype == '.') {
+  /* member of a struct in the frame, the '.' pushed its slot */
+  if (is_struct_lhs && frame_object(G, exp->left_operand->binop->left_operand) != NULL) {
+    write_s(G, "SVLS\n");
+  } else if (is_struct_lhs) {
     
     const BinaryOpNode_T *memberacc = exp->left_operand->binop; 
     const Datatype_T *struct_type = memberacc->left_operand->resolved;
@@ -335,8 +614,38 @@ static void generate_unary_expression(GenerateState_T *G, UnaryOpNode_T *exp) {
   generate_expression(G, exp->operand);
 }
 
+/* x = new T and x.m for a struct x kept in the frame, see analyze_escapes.
+ * returns false if EXP is anything else */
+static bool generate_frame_expression(GenerateState_T *G, BinaryOpNode_T *exp) {
+  Declaration_T *obj = frame_object(G, exp->left_operand);
+  const NodeExpression_T *me = exp->me;
+
+  if (obj == NULL) {
+    return false;
+  }
+
+  if (exp->optype == '=') {
+    write_s(G, "ALLOCL ");
+    write_int(G, obj->local_index);
+    write_s(G, " ");
+    write_int(G, local_slots(obj));
+    write_s(G, "\n");
+  } else {
+    /* the target of an assignment pushes its slot for SVLS */
+    bool is_target = me->parent != NULL && me->parent->type == EXP_BINARY 
+                     && me->parent->binop->optype == '=' && me->leaf == LEAF_LEFT;
+    write_s(G, is_target ? "IPUSH " : "LDL ");
+    write_int(G, frame_member_slot(obj, exp));
+    write_s(G, "\n");
+  }
+  return true;
+}
+
 /* assumes exp is of type EXP_BINARY */
 static void generate_binary_expression(GenerateState_T *G, BinaryOpNode_T *exp) {
+  if ((exp->optype == '=' || exp->optype == '.') && generate_frame_expression(G, exp)) {
+    return;
+  }
   generate_expression(G, exp->left_operand);
   generate_expression(G, exp->right_operand);
   switch (exp->optype) {
@@ -420,6 +729,7 @@ static void generate_identifier_expression(GenerateState_T *G, NodeExpression_T
 }
 
 static void generate_new_expression(GenerateState_T *G, NewNode_T *new) {
+  generate_stackmap(G);
   write_s(G, "ALLOC ");
   write_s(G, new->dt->type_name);
   write_s(G, "\n"); 
@@ -434,6 +744,7 @@ static void generate_call(GenerateState_T *G, CallNode_T *call) {
   if (call->func->type == EXP_IDENTIFIER) {
     bool is_cfunc = false;
     NodeFunction_T *func = get_function(G, call->func->identval);
+    generate_stackmap(G);
     if (func) {
       assert(func != NULL);
       write_s(G, "CALL ");
@@ -493,6 +804,8 @@ static void generate_block(GenerateState_T *G, ASTNode_T **blockp) {
 
   ASTNode_T *block = *blockp;
 
+  set_refslots(G, block->nodeblock->vars, true);
+
   for (ASTNode_T *c = block->nodeblock->children; c != NULL; c = c->next) {
     switch (c->type) {
       case NODE_FUNCTION:
@@ -530,6 +843,8 @@ static void generate_block(GenerateState_T *G, ASTNode_T **blockp) {
       break;
     }
   }
+
+  set_refslots(G, block->nodeblock->vars, false);
 }
 
 GenerateState_T *gen_init(ParseState_T *P, char *outfile) {
@@ -538,6 +853,8 @@ GenerateState_T *gen_init(ParseState_T *P, char *outfile) {
   G->P = P;
   G->at = P->root;
   G->lcount = 0;
+  G->nlocals = 0;
+  G->refslots = NULL;
   G->outfile = fopen(outfile, "wb");
   if (G->outfile == NULL) {
     fprintf(stderr, "couldn't open '%s' for reading.\n", outfile);
@@ -548,6 +865,7 @@ GenerateState_T *gen_init(ParseState_T *P, char *outfile) {
 
 void generate_bytecode(ParseState_T *P, char *outfile) {
   GenerateState_T *G = gen_init(P, outfile);
+  analyze_escapes(G);
   determine_local_indices(G);
 
   write_s(G, "JMP __ENTRY__\n");
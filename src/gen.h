@@ -10,6 +10,8 @@ typedef struct GenerateState {
   FILE *outfile;
   size_t lcount;
   size_t funclabel;
+  size_t nlocals;  /* local slots of the function being generated */
+  bool *refslots;  /* which of them hold a reference in the current scope */
 } GenerateState_T;
 
 void generate_bytecode(ParseState_T *P, char *);
@@ -2,70 +2,154 @@
 #include <string.h>
 #include <assert.h>
 #include "hash.h"
+#include "intern.h"
 
 /* this file contains a hashtable implementation used by various other parts of Spyre.
- * keys are C strings, values are void* */
+ * keys are C strings, values are void*.  a table keeps its keys as symbols
+ * from intern.c, so inserting never copies one and a lookup by symbol
+ * usually matches on the pointer
+ *
+ * entries are kept in a dense array in the order they were inserted, and
+ * hash_foreach walks that array.  struct layouts and the generated db
+ * sections come from iterating tables, so they follow the source rather
+ * than the hash function, and every build of a program is the same.
+ * lookups go through a separate open-addressed index of entry numbers,
+ * probed linearly.  each entry keeps its key's full hash, so a probe
+ * compares strings only when the hashes match and rebuilding the index
+ * never rehashes a key.  the index doubles once it is three quarters
+ * full, which keeps probe sequences short however many labels or types a
+ * program has; the entry array holds that many entries */
 
 /* default hash function that is used.  can be overwritten
- * by reassigning to SpyreHash_T->hash */
-/* credit: http://www.cse.yorku.ca/~oz/hash.html */
+ * by reassigning to SpyreHash_T->hash.  it is the one symbols are hashed
+ * with, so inserting a symbol reuses its hash */
 static size_t default_hash(const char *key) {
-  size_t h = 5381;
-  int c;
+  return string_hash(key, strlen(key));
+}
 
-  while ((c = *key++)) {
-    h = ((h << 5) + h) + c;
-  }
+static size_t max_entries(size_t capacity) {
+  return capacity/4*3;
+}
 
-  return h;
+/* the index slot naming KEY's entry, or the empty slot that ends its probe
+ * sequence */
+static size_t *find_slot(const SpyreHash_T *table, const char *key, size_t hash) {
+  size_t mask = table->capacity - 1;
+  size_t *slot;
+  const SpyreEntry_T *e;
+  for (size_t i = hash & mask;; i = (i + 1) & mask) {
+    slot = &table->index[i];
+    if (*slot == 0) {
+      return slot;
+    }
+    e = &table->entries[*slot - 1];
+    if (e->key == key || (e->hash == hash && !strcmp(e->key, key))) {
+      return slot;
+    }
+  }
 }
 
-static size_t condense_hash(SpyreHash_T *table, const char *key) {
-  return table->hash(key) % table->capacity;
+/* drops removed entries and rebuilds the index at CAPACITY slots */
+static void rebuild(SpyreHash_T *table, size_t capacity) {
+  size_t n = 0;
+  size_t mask = capacity - 1;
+  size_t i;
+
+  for (size_t e = 0; e < table->nentries; e++) {
+    if (table->entries[e].key != NULL) {
+      table->entries[n++] = table->entries[e];
+    }
+  }
+  table->nentries = n;
+  table->entries = realloc(table->entries, sizeof(SpyreEntry_T) * max_entries(capacity));
+  assert(table->entries);
+
+  free(table->index);
+  table->index = calloc(capacity, sizeof(size_t));
+  assert(table->index);
+  table->capacity = capacity;
+  for (size_t e = 0; e < n; e++) {
+    for (i = table->entries[e].hash & mask; table->index[i] != 0; i = (i + 1) & mask);
+    table->index[i] = e + 1;
+  }
 }
 
+/* inserting a key that is already present replaces its value and keeps
+ * its place in the order */
 void hash_insert(SpyreHash_T *table, const char *key, void *value) {
-  size_t index = condense_hash(table, key);
-  SpyreEntry_T *entry = malloc(sizeof(SpyreEntry_T));
-  assert(entry);
-  entry->value = value;
-  entry->key = malloc(strlen(key) + 1);
-  assert(entry->key);
-  strcpy(entry->key, key);
-
-  if (!table->buckets[index]) {
-    entry->next = NULL;
-    table->buckets[index] = entry;
-  } else {
-    entry->next = table->buckets[index];
-    table->buckets[index] = entry;
+  const char *symbol = intern(key);
+  size_t hash = table->hash == default_hash ? intern_hash(symbol) : table->hash(symbol);
+  size_t *slot = find_slot(table, symbol, hash);
+  SpyreEntry_T *e;
+
+  if (*slot != 0) {
+    table->entries[*slot - 1].value = value;
+    return;
   }
 
+  /* out of entries.  grow, unless enough were removed that compacting
+   * them makes the room */
+  if (table->nentries == max_entries(table->capacity)) {
+    rebuild(table, (table->size + 1)*4 > table->capacity*3/2 
+                   ? table->capacity*2 : table->capacity);
+    slot = find_slot(table, symbol, hash);
+  }
+
+  e = &table->entries[table->nentries++];
+  e->key = symbol;
+  e->value = value;
+  e->hash = hash;
+  *slot = table->nentries;
   table->size++;
 
 }
 
+/* removes KEY and returns its value, or NULL if it was not present.  the
+ * entry stays in the array, unnamed, until the next rebuild.  index slots
+ * after it in the same probe run are shifted back into the hole, so
+ * lookups never need to step over deleted slots */
 void *hash_remove(SpyreHash_T *table, const char *key) {
-  return NULL;
-}
+  size_t mask = table->capacity - 1;
+  size_t *slot = find_slot(table, key, table->hash(key));
+  size_t hole = (size_t)(slot - table->index);
+  size_t home;
+  SpyreEntry_T *e;
+  void *value;
 
-void *hash_get(SpyreHash_T *table, const char *key) {
-  size_t index = condense_hash(table, key);
-  for (SpyreEntry_T *e = table->buckets[index]; e != NULL; e = e->next) {
-    if (!strcmp(e->key, key)) {
-      return e->value;
+  if (*slot == 0) {
+    return NULL;
+  }
+  e = &table->entries[*slot - 1];
+  value = e->value;
+  e->key = NULL;
+
+  for (size_t i = (hole + 1) & mask; table->index[i] != 0; i = (i + 1) & mask) {
+    /* a slot may fill the hole only if the hole is on its probe path,
+     * that is between its home slot and where it sits now */
+    home = table->entries[table->index[i] - 1].hash & mask;
+    if (((i - home) & mask) >= ((i - hole) & mask)) {
+      table->index[hole] = table->index[i];
+      hole = i;
     }
   }
-  return NULL;
+  table->index[hole] = 0;
+  table->size--;
+
+  return value;
 }
 
+void *hash_get(SpyreHash_T *table, const char *key) {
+  size_t *slot = find_slot(table, key, table->hash(key));
+  return *slot != 0 ? table->entries[*slot - 1].value : NULL;
+}
+
+/* visits the entries in the order they were inserted */
 void hash_foreach(SpyreHash_T *table, 
                   void (*map)(const char *key, void *value, void *cl0),
                   void *cl) {
-  SpyreEntry_T *e;
-  for (size_t i = 0; i < table->capacity; i++) {
-    for (SpyreEntry_T *e = table->buckets[i]; e != NULL; e = e->next) {
-      map(e->key, e->value, cl); 
+  for (size_t i = 0; i < table->nentries; i++) {
+    if (table->entries[i].key != NULL) {
+      map(table->entries[i].key, table->entries[i].value, cl); 
     }
   }   
 }
@@ -74,18 +158,8 @@ void hash_foreach(SpyreHash_T *table,
  * destroy the values before freeing the table */
 void hash_free(SpyreHash_T **tablep) {
 	SpyreHash_T *table = *tablep;
-	SpyreEntry_T *entry, *next;
-	for (size_t i = 0; i < table->capacity; i++) {
-		if (table->buckets[i] != NULL) {
-			entry = table->buckets[i];	
-			while (entry != NULL) {
-				next = entry->next;
-				free(entry->key);
-				free(entry);
-				entry = next;
-			}
-		}
-	}
+	free(table->entries);
+	free(table->index);
 	free(table);
 	*tablep = NULL;
 }
@@ -96,7 +170,11 @@ SpyreHash_T *hash_init() {
   assert(table);
   table->hash = default_hash;
   table->capacity = HASH_INITIAL_CAPACITY;
-  table->buckets = calloc(HASH_INITIAL_CAPACITY, sizeof(SpyreEntry_T *));
+  table->index = calloc(HASH_INITIAL_CAPACITY, sizeof(size_t));
+  assert(table->index);
+  table->entries = malloc(sizeof(SpyreEntry_T) * max_entries(HASH_INITIAL_CAPACITY));
+  assert(table->entries);
+  table->nentries = 0;
   table->size = 0;
 
   return table;
@@ -5,15 +5,18 @@
 
 #define HASH_INITIAL_CAPACITY 16
 
+/* a removed entry has a NULL key */
 typedef struct SpyreEntry {
-  char *key;
+  const char *key;  /* interned, see intern.h */
   void *value;
-  struct SpyreEntry *next;
+  size_t hash;    /* full hash of key, compared before the key itself */
 } SpyreEntry_T;
 
 typedef struct SpyreHash {
-  SpyreEntry_T **buckets; 
-  size_t capacity;
+  SpyreEntry_T *entries;  /* in insertion order, iterated by hash_foreach */
+  size_t nentries;        /* entries used, including removed ones */
+  size_t *index;          /* capacity slots, entry number + 1 or 0 if empty */
+  size_t capacity;        /* always a power of two */
   size_t size;
   size_t (*hash)(const char *);
 } SpyreHash_T;
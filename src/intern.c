@@ -0,0 +1,126 @@
+#include <string.h>
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "intern.h"
+
+/* the process-wide symbol table.  the lexer interns every identifier as
+ * it reads it, and the parser, typechecker and generator pass those
+ * pointers around instead of copying the names, so a name is stored once
+ * however often it is used and comparing two names is comparing two
+ * pointers.  each symbol carries its hash in front of its characters,
+ * which lets hash tables keyed by symbols skip hashing them again.
+ * symbols are carved out of large chunks and never freed */
+
+#define INTERN_INITIAL_CAPACITY 1024
+#define INTERN_CHUNK_SIZE       65536
+
+typedef struct Symbol {
+  size_t hash;
+  size_t length;
+  char name[];
+} Symbol_T;
+
+static struct {
+  Symbol_T **slots;   /* open addressed, probed linearly */
+  size_t capacity;    /* always a power of two */
+  size_t size;
+  uint8_t *chunk;     /* where the next symbol goes */
+  size_t chunk_left;
+} symbols;
+
+/* credit: http://www.cse.yorku.ca/~oz/hash.html */
+size_t string_hash(const char *s, size_t length) {
+  size_t h = 5381;
+
+  for (size_t i = 0; i < length; i++) {
+    h = ((h << 5) + h) + (unsigned char)s[i];
+  }
+
+  return h;
+}
+
+static Symbol_T *symbol_of(const char *symbol) {
+  return (Symbol_T *)(symbol - offsetof(Symbol_T, name));
+}
+
+size_t intern_hash(const char *symbol) {
+  return symbol_of(symbol)->hash;
+}
+
+static Symbol_T *new_symbol(const char *s, size_t length, size_t hash) {
+  size_t bytes = (sizeof(Symbol_T) + length + 1 + sizeof(size_t) - 1) 
+                 & ~(sizeof(size_t) - 1);
+  Symbol_T *symbol;
+
+  if (bytes > INTERN_CHUNK_SIZE/4) {
+    symbol = malloc(bytes);
+    assert(symbol);
+  } else {
+    if (bytes > symbols.chunk_left) {
+      symbols.chunk = malloc(INTERN_CHUNK_SIZE);
+      assert(symbols.chunk);
+      symbols.chunk_left = INTERN_CHUNK_SIZE;
+    }
+    symbol = (Symbol_T *)symbols.chunk;
+    symbols.chunk += bytes;
+    symbols.chunk_left -= bytes;
+  }
+
+  symbol->hash = hash;
+  symbol->length = length;
+  memcpy(symbol->name, s, length);
+  symbol->name[length] = 0;
+  return symbol;
+}
+
+static void grow(void) {
+  Symbol_T **old = symbols.slots;
+  size_t old_capacity = symbols.capacity;
+  size_t mask;
+  size_t i;
+
+  symbols.capacity = old_capacity > 0 ? old_capacity*2 : INTERN_INITIAL_CAPACITY;
+  symbols.slots = calloc(symbols.capacity, sizeof(Symbol_T *));
+  assert(symbols.slots);
+  mask = symbols.capacity - 1;
+
+  for (size_t o = 0; o < old_capacity; o++) {
+    if (old[o] == NULL) {
+      continue;
+    }
+    for (i = old[o]->hash & mask; symbols.slots[i] != NULL; i = (i + 1) & mask);
+    symbols.slots[i] = old[o];
+  }
+  free(old);
+}
+
+/* the symbol for the LENGTH characters at S, which need not be terminated */
+const char *intern_span(const char *s, size_t length) {
+  size_t hash = string_hash(s, length);
+  size_t mask;
+  size_t i;
+  Symbol_T *symbol;
+
+  if ((symbols.size + 1)*4 > symbols.capacity*3) {
+    grow();
+  }
+
+  mask = symbols.capacity - 1;
+  for (i = hash & mask; symbols.slots[i] != NULL; i = (i + 1) & mask) {
+    symbol = symbols.slots[i];
+    if (symbol->hash == hash && symbol->length == length 
+        && !memcmp(symbol->name, s, length)) {
+      return symbol->name;
+    }
+  }
+
+  symbol = new_symbol(s, length, hash);
+  symbols.slots[i] = symbol;
+  symbols.size++;
+  return symbol->name;
+}
+
+const char *intern(const char *s) {
+  return intern_span(s, strlen(s));
+}
@@ -0,0 +1,13 @@
+#ifndef INTERN_H
+#define INTERN_H
+
+#include <stdlib.h>
+
+/* interned symbols.  equal names intern to the same pointer, which lives
+ * as long as the process, so symbols are compared with == */
+const char *intern(const char *);
+const char *intern_span(const char *, size_t length);
+size_t intern_hash(const char *symbol);
+size_t string_hash(const char *, size_t length);
+
+#endif
@@ -5,17 +5,23 @@
 #include <string.h>
 #include <stdarg.h>
 #include "lex.h"
+#include "intern.h"
 
 /* on_number constants */
 #define NOT_ON_NUMBER 0
 #define ON_INTEGER    1
 #define ON_FLOAT      2
 
+/* tokens reserved before the first one is read, doubled when full */
+#define LEX_INITIAL_TOKENS 1024
+
 /* maximum CHARACTER size of number literals */
 #define MAX_INTEGER_LENGTH 64
 #define MAX_FLOAT_LENGTH   64
 
 /* definitions for read_operator */
+/* operators longer than one character.  any other punctuation character is
+ * an operator on its own, with its ASCII code as opcode */
 static const struct {
   const char *operator;
   uint8_t    opcode;
@@ -44,6 +50,92 @@ static const struct {
   {":=",  SPECO_IMPLIED_EQ}
 };
 
+/* character classes, one table lookup decides what a character can start */
+#define CC_OTHER      0
+#define CC_SPACE      1
+#define CC_NEWLINE    2
+#define CC_DIGIT      3
+#define CC_IDENT      4  /* letters and '_' */
+#define CC_QUOTE      5
+#define CC_APOSTROPHE 6
+#define CC_OPERATOR   7
+
+static const uint8_t char_class[256] = {
+  [' ']  = CC_SPACE, ['\t'] = CC_SPACE, ['\r'] = CC_SPACE, 
+  ['\v'] = CC_SPACE, ['\f'] = CC_SPACE,
+  ['\n'] = CC_NEWLINE,
+  ['0' ... '9'] = CC_DIGIT,
+  ['a' ... 'z'] = CC_IDENT, ['A' ... 'Z'] = CC_IDENT, ['_'] = CC_IDENT,
+  ['"']  = CC_QUOTE,
+  ['\''] = CC_APOSTROPHE,
+  ['!'] = CC_OPERATOR, ['#' ... '&'] = CC_OPERATOR, ['(' ... '/'] = CC_OPERATOR,
+  [':' ... '@'] = CC_OPERATOR, ['[' ... '^'] = CC_OPERATOR, ['`'] = CC_OPERATOR,
+  ['{' ... '~'] = CC_OPERATOR
+};
+
+static inline bool is_ident_char(int c) {
+  return c != EOF && (char_class[(uint8_t)c] == CC_IDENT || char_class[(uint8_t)c] == CC_DIGIT);
+}
+
+/* keywords, placed by a perfect hash of their length and first and last
+ * characters.  a word is a keyword only if it is exactly the one in its
+ * slot, so identifiers such as ifx or double are never split */
+#define KEYWORD_HASH(s, n) ((3*(n) + (uint8_t)(s)[0] + (uint8_t)(s)[(n) - 1]) & 7)
+
+static const struct {
+  const char *word;
+  size_t length;
+  LexTokenType_T type;
+} keywords[8] = {
+  [0] = {"continue", 8, TOKEN_CONTINUE},
+  [1] = {"do",       2, TOKEN_DO},
+  [2] = {"return",   6, TOKEN_RETURN},
+  [3] = {"while",    5, TOKEN_WHILE},
+  [4] = {"break",    5, TOKEN_BREAK},
+  [5] = {"if",       2, TOKEN_IF},
+  [6] = {"else",     4, TOKEN_ELSE}
+};
+
+/* the keyword token type for the N characters at S, or TOKEN_IDENTIFIER */
+static LexTokenType_T keyword_type(const char *s, size_t n) {
+  size_t slot = KEYWORD_HASH(s, n);
+  if (keywords[slot].length == n && !memcmp(keywords[slot].word, s, n)) {
+    return keywords[slot].type;
+  }
+  return TOKEN_IDENTIFIER;
+}
+
+/* operators are matched by a DFA built from multi_operators at the first
+ * lex_file: a trie whose states record the opcode of the operator that
+ * ends there, or SPECO_NULL.  state 0 is the start.  the states reached by
+ * a single character take that character as their opcode */
+#define OP_MAX_STATES 64
+
+static struct {
+  uint8_t code;
+  uint8_t next[128];  /* state after each ASCII character, 0 for none */
+} op_states[OP_MAX_STATES];
+static size_t op_nstates = 0;
+
+static void build_operator_dfa(void) {
+  const char *c;
+  size_t s;
+
+  op_nstates = 1;
+  for (size_t i = 0; i < sizeof(multi_operators)/sizeof(multi_operators[0]); i++) {
+    s = 0;
+    for (c = multi_operators[i].operator; *c; c++) {
+      if (op_states[s].next[(uint8_t)*c] == 0) {
+        assert(op_nstates < OP_MAX_STATES);
+        op_states[op_nstates].code = s == 0 ? (uint8_t)*c : SPECO_NULL;
+        op_states[s].next[(uint8_t)*c] = (uint8_t)op_nstates++;
+      }
+      s = op_states[s].next[(uint8_t)*c];
+    }
+    op_states[s].code = multi_operators[i].opcode;
+  }
+}
+
 static void lex_err(LexState_T *L, const char *fmt, ...) {
 
   va_list varargs;
@@ -83,156 +175,92 @@ static inline int peek(LexState_T *L, int n) {
   return EOF;
 }
 
-static bool is_on_literal(LexState_T *L, const char *literal) {
-  int offset = 0;
-  for (const char *c = literal; *c; c++) {
-    if (peek(L, offset++) != *c) {
-      return false;
-    }
+/* the token's text as a symbol.  identifiers and string literals already
+ * are one.  operators and keywords are interned from their span of the
+ * source, there are only so many of them.  numbers and character literals
+ * are not, or every distinct literal in a large program would become a
+ * symbol that is never freed; the parser reads their value instead */
+static const char *token_tostring(const LexState_T *L, const LexToken_T *token) {
+  switch (token->type) {
+    case TOKEN_IDENTIFIER:
+    case TOKEN_STRING_LITERAL:
+      return token->sval;
+    case TOKEN_INTEGER:
+    case TOKEN_FLOAT:
+    case TOKEN_CHARACTER_LITERAL:
+      return NULL;
+    default:
+      return intern_span(&L->contents[token->offset], token->length);
   }
-  return true;
 }
 
-static char *token_tostring(LexToken_T *token) {
-  char *buf;
-  const char *word = NULL;
-
-  if (token->type == TOKEN_INTEGER || token->type == TOKEN_CHARACTER_LITERAL) {
-    buf = malloc(sizeof(char) * 16);
-    assert(buf);
-    snprintf(buf, 16, "%ld", token->ival);
-  } else if (token->type == TOKEN_FLOAT) {
-    buf = malloc(sizeof(char) * 32);
-    assert(buf);
-    snprintf(buf, 32, "%f", token->fval);
-  } else if (token->type == TOKEN_OPERATOR) {
-    for (size_t i = 0; i < sizeof(multi_operators)/sizeof(multi_operators[0]); i++) {
-      if (token->oval == multi_operators[i].opcode) {
-        word = multi_operators[i].operator;
-        break;
-      }
-    }
-    if (word) {
-      buf = malloc(strlen(word) + 1);
-      assert(buf);
-      strcpy(buf, word);
-    } else {
-      buf = malloc(2);
-      assert(buf);
-      buf[0] = token->oval;
-      buf[1] = 0;
-    }
-  } else {
-    switch (token->type) {
-      case TOKEN_UNDEFINED:
-        word = "?";
-        break;
-      case TOKEN_IDENTIFIER:
-      case TOKEN_STRING_LITERAL:
-        word = token->sval;
-        break;
-      case TOKEN_IF:
-        word = "if";
-        break;
-      case TOKEN_ELSE:
-        word = "else";
-        break;
-      case TOKEN_WHILE:
-        word = "while";
-        break;
-      case TOKEN_BREAK:
-        word = "break";
-        break;
-      case TOKEN_CONTINUE:
-        word = "continue";
-        break;
-      case TOKEN_DO:
-        word = "do";
-        break;
-      case TOKEN_RETURN:
-        word = "return";
-        break;
-      default:
-        word = "?";
-    }
-
-    buf = malloc(strlen(word) + 1);
-    strcpy(buf, word);
+/* the token's text for messages.  interns it if it has no as_string */
+const char *lex_token_text(const LexState_T *L, const LexToken_T *token) {
+  if (token->as_string != NULL) {
+    return token->as_string;
   }
-
-  return buf;
+  return intern_span(&L->contents[token->offset], token->length);
 }
 
-static void print_token(LexToken_T *token) {
+static void print_token(LexState_T *L, LexToken_T *token) {
 
-  printf("{TYPE: %d | WORD: %s | LINE: %d}\n", token->type, token->as_string, token->lineno); 
+  if (token->as_string != NULL) {
+    printf("{TYPE: %d | WORD: %s | LINE: %d}\n", token->type, token->as_string, token->lineno); 
+  } else {
+    printf("{TYPE: %d | WORD: %.*s | LINE: %d}\n", token->type, 
+           (int)token->length, &L->contents[token->offset], token->lineno); 
+  }
 
 }
 
-static void print_tokens(LexToken_T *head) {
-  for (LexToken_T *t = head; t != NULL; t = t->next) {
-    print_token(t);
+static void print_tokens(LexState_T *L) {
+  for (size_t i = 0; i < L->ntokens; i++) {
+    print_token(L, &L->tokens[i]);
   }
 }
 
-static LexToken_T *make_token(LexState_T *L, LexTokenType_T type, void *v) {
+/* appends a token for the source from START up to the current index */
+static LexToken_T *make_token(LexState_T *L, LexTokenType_T type, size_t start, const void *v) {
 
-  LexToken_T *token = malloc(sizeof(LexToken_T));
-  assert(token);
+  LexToken_T *token;
+
+  if (L->ntokens == L->tokens_capacity) {
+    L->tokens_capacity *= 2;
+    L->tokens = realloc(L->tokens, sizeof(LexToken_T) * L->tokens_capacity);
+    assert(L->tokens);
+  }
+  token = &L->tokens[L->ntokens++];
 
   token->lineno = L->lineno;
   token->type = type;
-  token->sval_ownership = false;
-  token->next = NULL;
+  token->offset = (uint32_t)start;
+  token->length = (uint32_t)(L->index - start);
 
   /* assign token value.  builtin keywords get no value */
   switch (token->type) {
     case TOKEN_INTEGER:
     case TOKEN_CHARACTER_LITERAL:
-      token->ival = *(int64_t *)v;
+      token->ival = *(const int64_t *)v;
       break;
     case TOKEN_FLOAT:
-      token->fval = *(double *)v;
+      token->fval = *(const double *)v;
       break;
     case TOKEN_IDENTIFIER:
     case TOKEN_STRING_LITERAL:
-      token->sval_ownership = true;
-      token->sval = (char *)v;
+      token->sval = v;
       break;
     case TOKEN_OPERATOR:
-      token->oval = *(uint8_t *)v;
+      token->oval = *(const uint8_t *)v;
       break;
     default:
       break;
   }
-  token->as_string = token_tostring(token);
-
-  /* insert token into main token list */
-  if (L->tokens == NULL) {
-    L->tokens = token;
-    L->backtoken = token;
-  } else {
-    L->backtoken->next = token;
-    L->backtoken = token;
-  }
+  token->as_string = token_tostring(L, token);
 
   return token;
 
 }
 
-static void free_token(LexToken_T **token) {
-
-  assert(token && *token);
-
-  if ((*token)->sval_ownership) {
-    free((*token)->sval);
-  }
-  free((*token)->as_string);
-  free(*token);
-  *token = NULL;
-
-}
-
 /* returns 0 for not on a number, 1 for integer, 2 for float */
 static int on_number(LexState_T *L) {
 
@@ -261,6 +289,7 @@ static int on_number(LexState_T *L) {
 
 static void read_float(LexState_T *L) {
 
+  size_t start = L->index;
   char fltbuf[MAX_FLOAT_LENGTH]; 
   bool has_seen_decimal = false;
 
@@ -282,11 +311,12 @@ static void read_float(LexState_T *L) {
 
   double value = strtod(fltbuf, NULL);
 
-  make_token(L, TOKEN_FLOAT, &value);
+  make_token(L, TOKEN_FLOAT, start, &value);
 }
 
 static void read_integer(LexState_T *L) {
 
+  size_t start = L->index;
   char intbuf[MAX_INTEGER_LENGTH]; 
 
   for (int i = 0; i < MAX_INTEGER_LENGTH - 1; i++) {
@@ -302,71 +332,60 @@ static void read_integer(LexState_T *L) {
 
   int64_t value = atoll(intbuf);
 
-  make_token(L, TOKEN_INTEGER, &value);
+  make_token(L, TOKEN_INTEGER, start, &value);
 
 }
 
+/* reads a whole word, then decides whether it is a keyword */
 static void read_identifier(LexState_T *L) {
 
+  size_t start = L->index;
   size_t ident_len = 1;
+  LexTokenType_T type;
 
   /* first get the length of the identifier.  start on 2nd character */
-  while (true) {
-    int look = peek(L, ident_len);
-    if (isspace(look) || (look != '_' && !isalnum(look))) {
-      break;
-    }
+  while (is_ident_char(peek(L, ident_len))) {
     ident_len++;
   }
 
-  /* copy identifier into a buffer */
-  char *word_buf = malloc(ident_len + 1);
-  assert(word_buf);
-  strncpy(word_buf, &L->contents[L->index], ident_len);
-  word_buf[ident_len] = 0;
+  type = keyword_type(&L->contents[start], ident_len);
   advance(L, ident_len);
 
-  make_token(L, TOKEN_IDENTIFIER, word_buf);
+  if (type != TOKEN_IDENTIFIER) {
+    make_token(L, type, start, NULL);
+  } else {
+    make_token(L, TOKEN_IDENTIFIER, start, intern_span(&L->contents[start], ident_len));
+  }
 
 }
 
+/* takes the longest operator at the current index through the DFA */
 static void read_operator(LexState_T *L) {
 
-  char *opbuf;
-  uint8_t code;
-  bool found_match = false;
-
-  for (int i = 0; i < sizeof(multi_operators)/sizeof(multi_operators[0]); i++) {
-    const char *operator = multi_operators[i].operator;
-    if (!strncmp(&L->contents[L->index], operator, strlen(operator))) {
-      found_match = true;
-      opbuf = malloc(strlen(operator) + 1);
-      code = multi_operators[i].opcode;
-      assert(opbuf);
-      strcpy(opbuf, operator);
-      break;
-    }
-  }
+  size_t start = L->index;
+  uint8_t code = (uint8_t)L->contents[start];
+  size_t length = 1;
+  size_t s = op_states[0].next[code];
+  int look;
 
-  if (found_match) {
-    advance(L, strlen(opbuf));
-  } else {
-    opbuf = malloc(2);
-    assert(opbuf);
-    opbuf[0] = get(L);
-    opbuf[1] = 0;
-    code = opbuf[0];
+  for (size_t i = 1; s != 0; i++) {
+    if (op_states[s].code != SPECO_NULL) {
+      code = op_states[s].code;
+      length = i;
+    }
+    look = peek(L, i);
+    s = look >= 0 && look < 128 ? op_states[s].next[look] : 0;
   }
 
-  free(opbuf);
-
-  make_token(L, TOKEN_OPERATOR, &code);
+  advance(L, length);
+  make_token(L, TOKEN_OPERATOR, start, &code);
 
 }
 
 static void read_string_literal(LexState_T *L) {
 
-  char *litbuf;
+  const char *literal;
+  size_t start = L->index;
   size_t buflen = 0;
 
   /* jump over opening quote */
@@ -388,18 +407,16 @@ static void read_string_literal(LexState_T *L) {
   /* jump over closing quote */
   advance(L, 1);
 
-  /* load buffer */
-  litbuf = malloc(buflen + 1);
-  assert(litbuf);
-  strncpy(litbuf, &L->contents[start_index], buflen);
-  litbuf[buflen] = 0;
+  literal = intern_span(&L->contents[start_index], buflen);
 
-  make_token(L, TOKEN_STRING_LITERAL, litbuf);
+  make_token(L, TOKEN_STRING_LITERAL, start, literal);
 
 }
 
 static void read_character_literal(LexState_T *L) {
 
+  size_t start = L->index;
+
   /* jump over opening quote */
   advance(L, 1);
 
@@ -410,7 +427,7 @@ static void read_character_literal(LexState_T *L) {
     lex_err(L, "malformed character literal");
   }
 
-  make_token(L, TOKEN_CHARACTER_LITERAL, &value);
+  make_token(L, TOKEN_CHARACTER_LITERAL, start, &value);
 
 }
 
@@ -422,8 +439,10 @@ static LexState_T *init_lexstate(const char *filename) {
   L->filename = malloc(strlen(filename) + 1);
   assert(L->filename);
   strcpy(L->filename, filename);
-  L->tokens = NULL;
-  L->backtoken = NULL;
+  L->tokens = malloc(sizeof(LexToken_T) * LEX_INITIAL_TOKENS);
+  assert(L->tokens);
+  L->ntokens = 0;
+  L->tokens_capacity = LEX_INITIAL_TOKENS;
   L->index = 0;
   L->lineno = 1;
 
@@ -437,6 +456,9 @@ static LexState_T *init_lexstate(const char *filename) {
   fseek(infile, 0, SEEK_END);
   L->flen = ftell(infile);
   fseek(infile, 0, SEEK_SET);
+  if (L->flen > UINT32_MAX) {
+    lex_err(L, "file is too large");
+  }
   L->contents = malloc(L->flen + 1);
   assert(L->contents);
   (void)fread(L->contents, 1, L->flen, infile);
@@ -451,14 +473,7 @@ void lex_cleanup(LexState_T **L) {
 
   assert(L && *L);
 
-  LexToken_T *token = (*L)->tokens;
-  LexToken_T *next;
-  while (token) {
-    next = token->next;
-    free_token(&token);
-    token = next;
-  }
-
+  free((*L)->tokens);
   free((*L)->filename);
   free((*L)->contents);
   free(*L);
@@ -470,6 +485,10 @@ LexState_T *lex_file(const char *filename) {
 
   LexState_T *L = init_lexstate(filename);
 
+  if (op_nstates == 0) {
+    build_operator_dfa();
+  }
+
   /* main lexing loop */
   while (true) {
     int c = at(L);
@@ -477,76 +496,41 @@ LexState_T *lex_file(const char *filename) {
       break;
     }
 
-    /* check for whitespace */
-    if (c == ' ' || c == '\t') {
-      advance(L, 1);
-      continue;
-    }
-
-    /* check for newline */
-    if (c == '\n') {
-      L->lineno++;
-      advance(L, 1);
-    }
-
-    /* check if we're on some sort of number literal */
-    int number_code = on_number(L);
-    if (number_code == ON_INTEGER) {
-      read_integer(L);
-    } else if (number_code == ON_FLOAT) {
-      read_float(L);
-    }
-
-    /* check for builtin keywords */
-    else if (is_on_literal(L, "if")) {
-      make_token(L, TOKEN_IF, NULL);
-      advance(L, strlen("if"));
-    } else if (is_on_literal(L, "else")) {
-      make_token(L, TOKEN_ELSE, "else");
-      advance(L, strlen("else"));
-    } else if (is_on_literal(L, "while")) {
-      make_token(L, TOKEN_WHILE, NULL);
-      advance(L, strlen("while"));
-    } else if (is_on_literal(L, "break")) {
-      make_token(L, TOKEN_BREAK, NULL);
-      advance(L, strlen("break"));
-    } else if (is_on_literal(L, "continue")) {
-      make_token(L, TOKEN_CONTINUE, NULL);
-      advance(L, strlen("continue"));
-    } else if (is_on_literal(L, "do")) {
-      make_token(L, TOKEN_DO, NULL);
-      advance(L, strlen("do"));
-    } else if (is_on_literal(L, "return")) {
-      make_token(L, TOKEN_RETURN, NULL);
-      advance(L, strlen("return"));
-    }
-
-    /* check for string literal */
-    else if (at(L) == '"') {
-      read_string_literal(L);
-    }
-
-    /* check for character literal */
-    else if (at(L) == '\'') {
-      read_character_literal(L);
-    }
-
-    /* check for identifier */
-    else if (isalpha(at(L)) || at(L) == '_') {
-      read_identifier(L);
-    }
-
-    /* check for operator */
-    else if (ispunct(at(L))) {
-      read_operator(L);
+    switch (char_class[(uint8_t)c]) {
+      case CC_SPACE:
+        advance(L, 1);
+        break;
+      case CC_NEWLINE:
+        L->lineno++;
+        advance(L, 1);
+        break;
+      case CC_DIGIT:
+        if (on_number(L) == ON_FLOAT) {
+          read_float(L);
+        } else {
+          read_integer(L);
+        }
+        break;
+      case CC_IDENT:
+        read_identifier(L);
+        break;
+      case CC_QUOTE:
+        read_string_literal(L);
+        break;
+      case CC_APOSTROPHE:
+        read_character_literal(L);
+        break;
+      case CC_OPERATOR:
+        read_operator(L);
+        break;
+      default:
+        lex_err(L, "unexpected character 0x%02x", (unsigned)(uint8_t)c);
     }
 
   }
   
   printf("===== PHASE ONE: LEXER =====\n"); 
-  for (LexToken_T *t = L->tokens; t != NULL; t = t->next) {
-    print_token(t);
-  }
+  print_tokens(L);
   printf("============================\n\n\n");
 
 
@@ -54,19 +54,21 @@ typedef enum LexTokenType {
   TOKEN_RETURN
 } LexTokenType_T;
 
+/* tokens are stored by value, one after another in LexState_T.tokens.
+ * a token's text is the span of the source it was read from */
 typedef struct LexToken {
   LexTokenType_T type;
   unsigned lineno;
-  bool sval_ownership;
+  uint32_t offset;          /* start of the token in LexState_T.contents */
+  uint32_t length;
   union {
     int64_t ival;
     uint8_t oval;
     double fval;
-    char *sval;
+    const char *sval;       /* interned, see intern.h */
   };
-  char *as_string;
-
-  struct LexToken *next;
+  const char *as_string;    /* interned.  NULL for numbers and character
+                             * literals, see lex_token_text */
 } LexToken_T;
 
 typedef struct LexState {
@@ -76,10 +78,17 @@ typedef struct LexState {
   size_t flen;
   size_t lineno;
   LexToken_T *tokens;
-  LexToken_T *backtoken;
+  size_t ntokens;
+  size_t tokens_capacity;
 } LexState_T;
 
+/* the token after T, or NULL at the end of the file */
+static inline LexToken_T *lex_next(const LexState_T *L, LexToken_T *t) {
+  return t + 1 < L->tokens + L->ntokens ? t + 1 : NULL;
+}
+
 LexState_T *lex_file(const char *);
+const char *lex_token_text(const LexState_T *, const LexToken_T *);
 void lex_cleanup(LexState_T **);
 
 #endif
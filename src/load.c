@@ -0,0 +1,286 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "load.h"
+#include "hash.h"
+
+/* this file turns a raw bytecode buffer into the pre-decoded instruction
+ * stream that the interpreter runs.  every reachable instruction becomes
+ * one aligned cell holding its handler and up to two operands.  jump and
+ * call targets are rewritten to cell pointers, and C function and type
+ * names (db strings) to indices into the registered function and type
+ * tables, so the interpreter never touches the raw bytes again.  SMAP
+ * pseudo-instructions are stripped out here and collected into the
+ * stack maps the garbage collector uses to find roots. */
+
+/* how the decoder treats an instruction's operands and control flow */
+typedef enum OpcodeKind {
+  OPK_PLAIN = 0, /* falls through to the next instruction */
+  OPK_BRANCH,    /* op0 is a jump target, may fall through */
+  OPK_JUMP,      /* op0 is a jump target, never falls through */
+  OPK_CALL,      /* op0 is a call target, returns to the next instruction */
+  OPK_CFUNC,     /* op0 is the address of a db string naming a C function */
+  OPK_TYPE,      /* op0 is the address of a db string naming a type */
+  OPK_MAP,       /* stack map for the next instruction, produces no cell */
+  OPK_END        /* never falls through */
+} OpcodeKind_T;
+
+static const struct {
+  uint8_t operands;
+  OpcodeKind_T kind;
+} opcodes[256] = {
+  [INS_HALT]    = {0, OPK_END},
+  [INS_IPUSH]   = {1, OPK_PLAIN},
+  [INS_LDL]     = {1, OPK_PLAIN},
+  [INS_SVL]     = {1, OPK_PLAIN},
+  [INS_RESL]    = {1, OPK_PLAIN},
+  [INS_LDMBR]   = {1, OPK_PLAIN},
+  [INS_SVMBR]   = {1, OPK_PLAIN},
+  [INS_ARG]     = {1, OPK_PLAIN},
+  [INS_ALLOC]   = {1, OPK_TYPE},
+  [INS_SMAP]    = {3, OPK_MAP},
+  [INS_ALLOCL]  = {2, OPK_PLAIN},
+  [INS_JMP]     = {1, OPK_JUMP},
+  [INS_JZ]      = {1, OPK_BRANCH},
+  [INS_JNZ]     = {1, OPK_BRANCH},
+  [INS_JGT]     = {1, OPK_BRANCH},
+  [INS_JGE]     = {1, OPK_BRANCH},
+  [INS_JLT]     = {1, OPK_BRANCH},
+  [INS_JLE]     = {1, OPK_BRANCH},
+  [INS_JEQ]     = {1, OPK_BRANCH},
+  [INS_JNEQ]    = {1, OPK_BRANCH},
+  [INS_CALL]    = {2, OPK_CALL},
+  [INS_CCALL]   = {2, OPK_CFUNC},
+  [INS_IRET]    = {0, OPK_END},
+  [INS_RET]     = {0, OPK_END},
+  [INS_IJEQ]    = {1, OPK_BRANCH},
+  [INS_IJNEQ]   = {1, OPK_BRANCH},
+  [INS_IJLT]    = {1, OPK_BRANCH},
+  [INS_IJLE]    = {1, OPK_BRANCH},
+  [INS_IJGT]    = {1, OPK_BRANCH},
+  [INS_IJGE]    = {1, OPK_BRANCH}
+};
+
+static void load_err(const char *fmt, size_t offset) {
+  fprintf(stderr, "Spyre Load error:\n");
+  fprintf(stderr, "\tmessage: ");
+  fprintf(stderr, fmt, offset);
+  fprintf(stderr, "\n");
+  exit(EXIT_FAILURE);
+}
+
+static void load_name_err(const char *what, const char *name, size_t offset) {
+  fprintf(stderr, "Spyre Load error:\n");
+  fprintf(stderr, "\tmessage: %s '%s' at offset %zu\n", what, name, offset);
+  exit(EXIT_FAILURE);
+}
+
+/* returns the nul-terminated db string at DATA, referenced by the
+ * instruction at AT */
+static const char *read_name(const uint8_t *bytecode, size_t length, 
+                             size_t data, size_t at) {
+  if (data >= length || memchr(&bytecode[data], '\0', length - data) == NULL) {
+    load_err("name reference out of range at offset %zu", at);
+  }
+  return (const char *)&bytecode[data];
+}
+
+static uint64_t read_operand(const uint8_t *bytecode, size_t at) {
+  uint64_t v;
+  memcpy(&v, &bytecode[at], sizeof(uint64_t));
+  return v;
+}
+
+static size_t instruction_size(uint8_t opcode) {
+  return 1 + opcodes[opcode].operands*sizeof(uint64_t);
+}
+
+/* follows control flow from the entry point and marks the offset of every
+ * reachable instruction.  code and data are interleaved in the bytecode, so
+ * a linear sweep would try to decode db strings as instructions */
+static size_t mark_reachable(const uint8_t *bytecode, size_t length, bool *is_start) {
+
+  size_t ninstructions = 0;
+  size_t *work = malloc(sizeof(size_t) * (length + 1));
+  size_t nwork = 0;
+  spyre_assert(work != NULL);
+
+  work[nwork++] = 0;
+  while (nwork > 0) {
+    size_t at = work[--nwork];
+    while (!is_start[at]) {
+      if (at >= length) {
+        load_err("execution runs past the end of the bytecode (offset %zu)", at);
+      }
+      uint8_t opcode = bytecode[at];
+      size_t size = instruction_size(opcode);
+      if (at + size > length) {
+        load_err("truncated instruction at offset %zu", at);
+      }
+      is_start[at] = true;
+      if (opcodes[opcode].kind != OPK_MAP) {
+        ninstructions++;
+      }
+
+      switch (opcodes[opcode].kind) {
+        case OPK_BRANCH:
+        case OPK_JUMP:
+        case OPK_CALL: {
+          size_t target = read_operand(bytecode, at + 1);
+          if (target >= length) {
+            load_err("jump target out of range at offset %zu", at);
+          }
+          if (!is_start[target]) {
+            work[nwork++] = target;
+          }
+          break;
+        }
+        default:
+          break;
+      }
+
+      if (opcodes[opcode].kind == OPK_JUMP || opcodes[opcode].kind == OPK_END) {
+        break;
+      }
+      at += size;
+    }
+  }
+
+  free(work);
+  return ninstructions;
+}
+
+/* SMAP nlocals word bits: BITS marks which of local slots word*32 to
+ * word*32 + 31 hold references at the instruction that follows.  every
+ * SMAP in front of the same instruction adds to one map */
+static void add_stackmap(SpyreState_T *S, size_t *words_capacity, size_t cell,
+                         const uint8_t *bytecode, size_t at) {
+  size_t nlocals = read_operand(bytecode, at + 1);
+  size_t word = read_operand(bytecode, at + 9);
+  uint64_t bits = read_operand(bytecode, at + 17);
+  size_t nwords = (nlocals + 31) / 32;
+  SpyreStackMap_T *map = S->nstackmaps > 0 ? &S->stackmaps[S->nstackmaps - 1] : NULL;
+
+  if (map == NULL || map->cell != cell) {
+    map = &S->stackmaps[S->nstackmaps++];
+    map->cell = cell;
+    map->nlocals = nlocals;
+    map->refs = 0;
+    if (S->nstackmaps > 1) {
+      SpyreStackMap_T *prev = map - 1;
+      map->refs = prev->refs + (prev->nlocals + 31) / 32;
+    }
+    if (map->refs + nwords > *words_capacity) {
+      *words_capacity = (map->refs + nwords) * 2;
+      S->stackmap_words = realloc(S->stackmap_words, 
+                                  sizeof(uint32_t) * *words_capacity);
+      spyre_assert(S->stackmap_words != NULL);
+    }
+    memset(&S->stackmap_words[map->refs], 0, sizeof(uint32_t) * nwords);
+  }
+
+  if (nlocals != map->nlocals || word >= nwords || bits > UINT32_MAX) {
+    load_err("malformed stack map at offset %zu", at);
+  }
+  S->stackmap_words[map->refs + word] |= (uint32_t)bits;
+}
+
+/* decodes LENGTH bytes of BYTECODE into a cell array whose first cell is the
+ * entry point.  HANDLERS maps each opcode to its interpreter label; when it
+ * is NULL (switch dispatch) the cells carry the raw opcode instead */
+SpyreCell_T *spyload_decode(SpyreState_T *S, const uint8_t *bytecode, size_t length,
+                            const void **handlers) {
+
+  bool *is_start = calloc(length + 1, sizeof(bool));
+  size_t *cell_index = malloc(sizeof(size_t) * (length + 1));
+  spyre_assert(is_start != NULL && cell_index != NULL);
+
+  size_t ncells = mark_reachable(bytecode, length, is_start);
+  SpyreCell_T *cells = malloc(sizeof(SpyreCell_T) * ncells);
+  spyre_assert(cells != NULL);
+
+  /* number the instructions in address order.  reachable instructions
+   * may not overlap, otherwise fall-through would be ambiguous */
+  size_t next = 0;
+  size_t end = 0;
+  size_t nsmaps = 0;
+  for (size_t at = 0; at < length; at++) {
+    if (!is_start[at]) {
+      continue;
+    }
+    if (at < end) {
+      load_err("overlapping instructions at offset %zu", at);
+    }
+
+    /* a stack map becomes part of the instruction after it, so jumps to
+     * it land on that instruction's cell */
+    if (opcodes[bytecode[at]].kind == OPK_MAP) {
+      cell_index[at] = next;
+      nsmaps++;
+    } else {
+      cell_index[at] = next++;
+    }
+    end = at + instruction_size(bytecode[at]);
+  }
+
+  size_t words_capacity = 0;
+  S->stackmaps = malloc(sizeof(SpyreStackMap_T) * (nsmaps > 0 ? nsmaps : 1));
+  S->nstackmaps = 0;
+  S->stackmap_words = NULL;
+  spyre_assert(S->stackmaps != NULL);
+
+  for (size_t at = 0; at < length; at++) {
+    if (!is_start[at]) {
+      continue;
+    }
+    uint8_t opcode = bytecode[at];
+    SpyreCell_T *cell = &cells[cell_index[at]];
+
+    if (opcodes[opcode].kind == OPK_MAP) {
+      add_stackmap(S, &words_capacity, cell_index[at], bytecode, at);
+      continue;
+    }
+
+    if (handlers != NULL) {
+      cell->handler = handlers[opcode];
+    } else {
+      cell->opcode = opcode;
+    }
+    cell->op0 = opcodes[opcode].operands > 0 ? read_operand(bytecode, at + 1) : 0;
+    cell->op1 = opcodes[opcode].operands > 1 ? read_operand(bytecode, at + 9) : 0;
+
+    switch (opcodes[opcode].kind) {
+      case OPK_BRANCH:
+      case OPK_JUMP:
+      case OPK_CALL:
+        cell->op0 = (uint64_t)(uintptr_t)&cells[cell_index[cell->op0]];
+        break;
+      case OPK_CFUNC: {
+        const char *name = read_name(bytecode, length, cell->op0, at);
+        SpyreFunction_T *cfunc = hash_get(S->cfuncs, name);
+        if (cfunc == NULL) {
+          load_name_err("unknown C function", name, at);
+        }
+        cell->op0 = cfunc->index;
+        break;
+      }
+      case OPK_TYPE: {
+        const char *name = read_name(bytecode, length, cell->op0, at);
+        SpyreInternalType_T *type = get_type(S, name);
+        if (type == NULL) {
+          load_name_err("unknown type", name, at);
+        }
+        cell->op0 = type->type_id;
+        break;
+      }
+      default:
+        break;
+    }
+  }
+
+  free(is_start);
+  free(cell_index);
+
+  S->ncells = ncells;
+  return cells;
+}
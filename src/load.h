@@ -0,0 +1,8 @@
+#ifndef LOAD_H
+#define LOAD_H
+
+#include "spyre.h"
+
+SpyreCell_T *spyload_decode(SpyreState_T *, const uint8_t *, size_t, const void **);
+
+#endif
@@ -18,7 +18,63 @@ typedef enum CompileMode {
 
 void usage() {
   printf("usage: spyre [-c spyre_file] [-a spyre_asm_file]\n"
-         "             [-r spyre_bytecode_file]\n");
+         "             [-r spyre_bytecode_file]\n"
+         "             [--max-stack size[k|m|g]]\n"
+         "             [--heap-initial size[k|m|g]] [--heap-growth factor]\n"
+         "             [--nursery-size size[k|m|g]] [--gc-threads count]\n"
+         "             [--gc-slice microseconds] [--gc-stats]\n");
+}
+
+/* parses a byte count with an optional k, m or g suffix.  0 is allowed,
+ * for options where it turns something off */
+size_t parse_size_or_zero(const char *flag, const char *arg) {
+  char *end;
+  unsigned long long value = strtoull(arg, &end, 10);
+  switch (*end) {
+    case 'k': case 'K': value <<= 10; end++; break;
+    case 'm': case 'M': value <<= 20; end++; break;
+    case 'g': case 'G': value <<= 30; end++; break;
+    default: break;
+  }
+  if (end == arg || *end != '\0') {
+    fprintf(stderr, "invalid size '%s' for flag '%s'\n", arg, flag);
+    exit(EXIT_FAILURE);
+  }
+  return (size_t)value;
+}
+
+/* parses a byte count as above that must not be 0 */
+size_t parse_size(const char *flag, const char *arg) {
+  size_t value = parse_size_or_zero(flag, arg);
+  if (value == 0) {
+    fprintf(stderr, "invalid size '%s' for flag '%s'\n", arg, flag);
+    exit(EXIT_FAILURE);
+  }
+  return value;
+}
+
+void set_size_option(int *argn, size_t *option, int argc, char **argv, bool allow_zero) {
+  if (*argn >= argc - 1) {
+    fprintf(stderr, "expected size following flag '%s'\n", argv[*argn]);
+    exit(EXIT_FAILURE);
+  }
+  *option = allow_zero ? parse_size_or_zero(argv[*argn], argv[*argn + 1])
+                       : parse_size(argv[*argn], argv[*argn + 1]);
+  (*argn)++;
+}
+
+void set_count_option(int *argn, size_t *option, int argc, char **argv) {
+  char *end;
+  if (*argn >= argc - 1) {
+    fprintf(stderr, "expected count following flag '%s'\n", argv[*argn]);
+    exit(EXIT_FAILURE);
+  }
+  *option = (size_t)strtoull(argv[*argn + 1], &end, 10);
+  if (end == argv[*argn + 1] || *end != '\0') {
+    fprintf(stderr, "invalid count '%s' for flag '%s'\n", argv[*argn + 1], argv[*argn]);
+    exit(EXIT_FAILURE);
+  }
+  (*argn)++;
 }
 
 void set_compile_mode(CompileMode_T *compile_mode, int *argn, char **infile, 
@@ -32,7 +88,7 @@ void set_compile_mode(CompileMode_T *compile_mode, int *argn, char **infile,
     exit(EXIT_FAILURE);
   }
   *infile = argv[*argn + 1]; 
-  (void)*argn++;
+  (*argn)++;
   *compile_mode = set_mode;
 }
 
@@ -42,7 +98,22 @@ void set_output_file(int *argn, char **outfile, int argc, char **argv) {
     exit(EXIT_FAILURE);
   }
   *outfile = argv[*argn + 1];
-  (void)*argn++;
+  (*argn)++;
+}
+
+void set_factor_option(int *argn, double *option, int argc, char **argv) {
+  char *end;
+  if (*argn >= argc - 1) {
+    fprintf(stderr, "expected factor following flag '%s'\n", argv[*argn]);
+    exit(EXIT_FAILURE);
+  }
+  *option = strtod(argv[*argn + 1], &end);
+  if (end == argv[*argn + 1] || *end != '\0' || *option < 1.0) {
+    fprintf(stderr, "invalid factor '%s' for flag '%s', must be at least 1\n", 
+            argv[*argn + 1], argv[*argn]);
+    exit(EXIT_FAILURE);
+  }
+  (*argn)++;
 }
 
 int main(int argc, char **argv) {
@@ -57,6 +128,10 @@ int main(int argc, char **argv) {
   char *temp_asm_file = ".spyre_asm_output";
   char *infile = NULL;
   char *outfile = NULL;
+  char *positional = NULL;
+  SpyreConfig_T config;
+
+  spyre_config_defaults(&config);
 
   for (int i = 1; i < argc; i++) {
     if (!strcmp(argv[i], "-c")) {
@@ -67,19 +142,38 @@ int main(int argc, char **argv) {
       set_compile_mode(&compile_mode, &i, &infile, argc, argv, COMP_EXECUTE);
     } else if (!strcmp(argv[i], "-o")) {
       set_output_file(&i, &outfile, argc, argv);
+    } else if (!strcmp(argv[i], "--max-stack")) {
+      set_size_option(&i, &config.max_stack_size, argc, argv, false);
+    } else if (!strcmp(argv[i], "--heap-initial")) {
+      set_size_option(&i, &config.heap_initial, argc, argv, false);
+    } else if (!strcmp(argv[i], "--heap-growth")) {
+      set_factor_option(&i, &config.heap_growth, argc, argv);
+    } else if (!strcmp(argv[i], "--nursery-size")) {
+      set_size_option(&i, &config.nursery_size, argc, argv, true);
+    } else if (!strcmp(argv[i], "--gc-threads")) {
+      set_count_option(&i, &config.gc_threads, argc, argv);
+    } else if (!strcmp(argv[i], "--gc-slice")) {
+      set_count_option(&i, &config.gc_slice_us, argc, argv);
+    } else if (!strcmp(argv[i], "--gc-stats")) {
+      config.gc_stats = true;
     } else if (!strcmp(argv[i], "--help")) {
       usage();
       return EXIT_SUCCESS;
+    } else if (positional == NULL) {
+      positional = argv[i];
+    } else {
+      fprintf(stderr, "unexpected argument '%s'\n", argv[i]);
+      exit(EXIT_FAILURE);
     }
   }
 
   /* everything? */
   if (compile_mode == COMP_NONE) {
-    if (argc != 2) {
-      fprintf(stderr, "expected exactly one input file");
+    if (positional == NULL) {
+      fprintf(stderr, "expected exactly one input file\n");
       exit(EXIT_FAILURE);
     }
-    infile = argv[1];
+    infile = positional;
     compile_mode = COMP_ALL;
   }
 
@@ -101,7 +195,7 @@ int main(int argc, char **argv) {
       typecheck_syntax_tree(P);
       generate_bytecode(P, temp_comp_file);
       assemble_file(temp_comp_file, temp_asm_file);
-      spyre_execute_with_context(temp_asm_file, P);
+      spyre_execute_with_context(temp_asm_file, P, &config);
       lex_cleanup(&L);
       parse_cleanup(&P);
       break;
@@ -117,7 +211,7 @@ int main(int argc, char **argv) {
       assemble_file(infile, outfile);			
       break;
     case COMP_EXECUTE:
-      spyre_execute_file(infile);		
+      spyre_execute_file(infile, &config);		
       break;
     default:
       break;
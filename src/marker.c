@@ -0,0 +1,321 @@
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <sched.h>
+#include <pthread.h>
+#include "marker.h"
+#include "memory.h"
+
+/* this file implements the parallel mark phase of full collections.  a
+ * pool of worker threads is started with the VM and parked until gc.c
+ * has grayed the roots.  the roots are then dealt out to one work-stealing
+ * deque per thread, the calling thread joins in as worker 0, and each
+ * worker drains its own deque, stealing from the others when it runs dry.
+ * segments are claimed by atomically setting their bit in the mark
+ * bitmap, so each is scanned exactly once */
+
+#define DEQUE_INITIAL_SIZE 1024
+
+/* seg_id 0 is never allocated, so it doubles as the empty result */
+#define DEQUE_EMPTY ((size_t)0)
+#define DEQUE_ABORT SIZE_MAX
+
+typedef struct MarkArray {
+  int64_t size;              /* power of two */
+  struct MarkArray *retired; /* the array this one replaced */
+  size_t slots[];
+} MarkArray_T;
+
+/* Chase-Lev deque of seg_ids.  the owner pushes and takes at the bottom,
+ * other workers steal from the top.  an array outgrown by the owner may
+ * still be read by a thief, so it is only freed once the cycle is over */
+typedef struct MarkDeque {
+  _Alignas(64) int64_t top;
+  _Alignas(64) int64_t bottom;
+  MarkArray_T *array;
+} MarkDeque_T;
+
+typedef struct MarkWorker {
+  struct SpyreMarker *marker;
+  size_t id;
+  pthread_t thread;
+} MarkWorker_T;
+
+typedef struct SpyreMarker {
+  SpyreState_T *S;
+  size_t nthreads;       /* including the collecting thread */
+  MarkDeque_T *deques;   /* one per thread, indexed by worker id */
+  MarkWorker_T *workers; /* ids 1 to nthreads - 1 */
+  pthread_mutex_t lock;
+  pthread_cond_t start;  /* a cycle has begun */
+  pthread_cond_t finish; /* a worker has left the cycle */
+  uint64_t cycle;
+  size_t finished;
+  size_t idle;           /* workers that found no work, updated atomically */
+} SpyreMarker_T;
+
+static MarkArray_T *array_new(int64_t size) {
+  MarkArray_T *array = malloc(sizeof(MarkArray_T) + sizeof(size_t) * size);
+  spyre_assert(array != NULL);
+  array->size = size;
+  array->retired = NULL;
+  return array;
+}
+
+static void deque_grow(MarkDeque_T *deque, int64_t top, int64_t bottom) {
+  MarkArray_T *old = deque->array;
+  MarkArray_T *array = array_new(old->size*2);
+  for (int64_t i = top; i < bottom; i++) {
+    array->slots[i & (array->size - 1)] = old->slots[i & (old->size - 1)];
+  }
+  array->retired = old;
+  __atomic_store_n(&deque->array, array, __ATOMIC_RELEASE);
+}
+
+static void deque_push(MarkDeque_T *deque, size_t seg_id) {
+  int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+  int64_t top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+  MarkArray_T *array = deque->array;
+
+  if (bottom - top > array->size - 1) {
+    deque_grow(deque, top, bottom);
+    array = deque->array;
+  }
+  __atomic_store_n(&array->slots[bottom & (array->size - 1)], seg_id, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+}
+
+static size_t deque_take(MarkDeque_T *deque) {
+  int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1;
+  MarkArray_T *array = deque->array;
+  int64_t top;
+  size_t seg_id = DEQUE_EMPTY;
+
+  __atomic_store_n(&deque->bottom, bottom, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  top = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+
+  if (top <= bottom) {
+    seg_id = __atomic_load_n(&array->slots[bottom & (array->size - 1)], __ATOMIC_RELAXED);
+    if (top == bottom) {
+      /* last one, race the thieves for it */
+      if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, false,
+                                       __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+        seg_id = DEQUE_EMPTY;
+      }
+      __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+    }
+  } else {
+    __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+  }
+  return seg_id;
+}
+
+static size_t deque_steal(MarkDeque_T *deque) {
+  int64_t top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+
+  if (top >= bottom) {
+    return DEQUE_EMPTY;
+  }
+  MarkArray_T *array = __atomic_load_n(&deque->array, __ATOMIC_ACQUIRE);
+  size_t seg_id = __atomic_load_n(&array->slots[top & (array->size - 1)], __ATOMIC_RELAXED);
+  if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, false,
+                                   __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+    return DEQUE_ABORT;
+  }
+  return seg_id;
+}
+
+static bool deque_nonempty(MarkDeque_T *deque) {
+  return __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE)
+         < __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+}
+
+/* frees the arrays DEQUE outgrew during the last cycle */
+static void deque_release_retired(MarkDeque_T *deque) {
+  MarkArray_T *array = deque->array->retired;
+  while (array != NULL) {
+    MarkArray_T *next = array->retired;
+    free(array);
+    array = next;
+  }
+  deque->array->retired = NULL;
+}
+
+/* true if this thread set the mark, false if someone else got there first */
+static bool try_mark(SpyreMemoryMap_T *memory, size_t seg_id) {
+  uint64_t *word = &memory->mark_bits[MEM_BIT_WORD(seg_id)];
+  uint64_t bit = MEM_BIT(seg_id);
+  return !(__atomic_load_n(word, __ATOMIC_RELAXED) & bit)
+         && !(__atomic_fetch_or(word, bit, __ATOMIC_RELAXED) & bit);
+}
+
+static void scan(SpyreMarker_T *marker, MarkDeque_T *own, size_t seg_id) {
+  SpyreState_T *S = marker->S;
+  MemoryDescriptor_T *mdesc = (MemoryDescriptor_T *)S->memory->allocs[seg_id];
+  SpyreInternalType_T *typeinfo = S->types[mdesc->type_id];
+  SpyreInternalMember_T *member;
+  uint8_t *rawbuf = spymem_rawbuf(S, seg_id);
+  size_t mem_seg_id;
+
+  for (size_t i = 0; i < typeinfo->nmembers; i++) {
+    member = typeinfo->members[i];
+    if (member->type->nmembers > 0) {
+      mem_seg_id = *(size_t *)&rawbuf[member->byte_offset];
+      if (mem_seg_id != 0 && try_mark(S->memory, mem_seg_id)) {
+        deque_push(own, mem_seg_id);
+      }
+    }
+  }
+}
+
+/* tries every other worker's deque once, starting after our own */
+static size_t steal_any(SpyreMarker_T *marker, size_t id) {
+  bool contended;
+  size_t seg_id;
+
+  do {
+    contended = false;
+    for (size_t k = 1; k < marker->nthreads; k++) {
+      seg_id = deque_steal(&marker->deques[(id + k) % marker->nthreads]);
+      if (seg_id == DEQUE_ABORT) {
+        contended = true;
+      } else if (seg_id != DEQUE_EMPTY) {
+        return seg_id;
+      }
+    }
+  } while (contended);
+
+  return DEQUE_EMPTY;
+}
+
+/* a worker only goes idle with an empty deque, and only busy workers push,
+ * so once every worker is idle at the same time no work is left anywhere */
+static void mark_loop(SpyreMarker_T *marker, size_t id) {
+  MarkDeque_T *own = &marker->deques[id];
+  size_t seg_id;
+
+  for (;;) {
+    while ((seg_id = deque_take(own)) != DEQUE_EMPTY) {
+      scan(marker, own, seg_id);
+    }
+    if ((seg_id = steal_any(marker, id)) != DEQUE_EMPTY) {
+      scan(marker, own, seg_id);
+      continue;
+    }
+
+    __atomic_add_fetch(&marker->idle, 1, __ATOMIC_SEQ_CST);
+    for (;;) {
+      if (__atomic_load_n(&marker->idle, __ATOMIC_SEQ_CST) == marker->nthreads) {
+        return;
+      }
+      bool found = false;
+      for (size_t k = 1; k < marker->nthreads && !found; k++) {
+        found = deque_nonempty(&marker->deques[(id + k) % marker->nthreads]);
+      }
+      if (found) {
+        __atomic_sub_fetch(&marker->idle, 1, __ATOMIC_SEQ_CST);
+        break;
+      }
+      sched_yield();
+    }
+  }
+}
+
+static void *worker_main(void *arg) {
+  MarkWorker_T *worker = arg;
+  SpyreMarker_T *marker = worker->marker;
+  uint64_t seen = 0;
+
+  for (;;) {
+    pthread_mutex_lock(&marker->lock);
+    while (marker->cycle == seen) {
+      pthread_cond_wait(&marker->start, &marker->lock);
+    }
+    seen = marker->cycle;
+    pthread_mutex_unlock(&marker->lock);
+
+    mark_loop(marker, worker->id);
+
+    pthread_mutex_lock(&marker->lock);
+    marker->finished++;
+    pthread_cond_signal(&marker->finish);
+    pthread_mutex_unlock(&marker->lock);
+  }
+
+  return NULL;
+}
+
+/* starts NTHREADS - 1 mark workers for S.  returns NULL when marking
+ * should stay on the collecting thread */
+SpyreMarker_T *spymark_init(SpyreState_T *S, size_t nthreads) {
+  if (nthreads <= 1) {
+    return NULL;
+  }
+
+  SpyreMarker_T *marker = malloc(sizeof(SpyreMarker_T));
+  spyre_assert(marker != NULL);
+  marker->S = S;
+  marker->nthreads = nthreads;
+  marker->cycle = 0;
+  marker->finished = 0;
+  marker->idle = 0;
+  marker->deques = aligned_alloc(_Alignof(MarkDeque_T), sizeof(MarkDeque_T) * nthreads);
+  marker->workers = malloc(sizeof(MarkWorker_T) * nthreads);
+  spyre_assert(marker->deques != NULL && marker->workers != NULL);
+  pthread_mutex_init(&marker->lock, NULL);
+  pthread_cond_init(&marker->start, NULL);
+  pthread_cond_init(&marker->finish, NULL);
+
+  for (size_t i = 0; i < nthreads; i++) {
+    marker->deques[i].top = 0;
+    marker->deques[i].bottom = 0;
+    marker->deques[i].array = array_new(DEQUE_INITIAL_SIZE);
+  }
+  for (size_t i = 1; i < nthreads; i++) {
+    marker->workers[i].marker = marker;
+    marker->workers[i].id = i;
+    if (pthread_create(&marker->workers[i].thread, NULL, worker_main,
+                       &marker->workers[i]) != 0) {
+      fprintf(stderr, "SPYRE CRITICAL: couldn't start mark thread\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  return marker;
+}
+
+/* marks everything reachable from the gray stack, which holds the already
+ * marked roots, then returns with all workers parked again */
+void spymark_drain(SpyreState_T *S) {
+  SpyreMarker_T *marker = S->marker;
+  SpyreMemoryMap_T *memory = S->memory;
+
+  /* the workers are parked, so the deques can be filled directly */
+  for (size_t i = 0; i < memory->ngray; i++) {
+    deque_push(&marker->deques[i % marker->nthreads], memory->gray[i]);
+  }
+  memory->ngray = 0;
+
+  pthread_mutex_lock(&marker->lock);
+  marker->idle = 0;
+  marker->finished = 0;
+  marker->cycle++;
+  pthread_cond_broadcast(&marker->start);
+  pthread_mutex_unlock(&marker->lock);
+
+  mark_loop(marker, 0);
+
+  pthread_mutex_lock(&marker->lock);
+  while (marker->finished < marker->nthreads - 1) {
+    pthread_cond_wait(&marker->finish, &marker->lock);
+  }
+  pthread_mutex_unlock(&marker->lock);
+
+  for (size_t i = 0; i < marker->nthreads; i++) {
+    deque_release_retired(&marker->deques[i]);
+  }
+}
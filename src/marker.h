@@ -0,0 +1,9 @@
+#ifndef MARKER_H
+#define MARKER_H
+
+#include "spyre.h"
+
+struct SpyreMarker *spymark_init(SpyreState_T *, size_t);
+void spymark_drain(SpyreState_T *);
+
+#endif
@@ -1,7 +1,10 @@
+#define _DEFAULT_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include "memory.h"
+#include "gc.h"
 
 uint8_t *spymem_rawbuf(SpyreState_T *S, size_t seg_id) {
 	
@@ -13,82 +16,438 @@ uint8_t *spymem_rawbuf(SpyreState_T *S, size_t seg_id) {
 
 }
 
-size_t spymem_alloc(SpyreState_T *S, MemoryDescriptor_T *memdesc) {
+/* objects are carved from per-size-class slabs.  struct payloads are
+ * always a whole number of words, so each word count up to
+ * MEM_SMALL_WORDS gets its own class of header + payload sized cells.
+ * freed cells go onto their class free list and are reused before the
+ * slab tail.  slabs are aligned to their size, so a cell finds its slab
+ * by masking its address.  memory goes back to the system only when
+ * compaction empties a slab, see spymem_compact */
+
+/* build with -DSPYMEM_NO_SLABS to give every object its own calloc, for
+ * comparison in bench/alloc.c */
+#ifdef SPYMEM_NO_SLABS
+#define SLAB_MAX_WORDS 0
+#else
+#define SLAB_MAX_WORDS MEM_SMALL_WORDS
+#endif
+
+static size_t cell_size(size_t words) {
+  return sizeof(MemoryDescriptor_T) + words*8;
+}
+
+/* payload words of an object of TYPE.  scalars still take one word */
+static size_t type_words(SpyreInternalType_T *type) {
+  return type->nmembers > 0 ? type->nmembers : 1;
+}
+
+static size_t slab_cells(size_t words) {
+  return (MEM_SLAB_SIZE - sizeof(SpyreSlab_T)) / cell_size(words);
+}
+
+static SpyreSlab_T *slab_of(uint8_t *cell) {
+  return (SpyreSlab_T *)((uintptr_t)cell & ~(uintptr_t)(MEM_SLAB_SIZE - 1));
+}
+
+/* maps twice the slab size and trims it down to one aligned slab */
+static SpyreSlab_T *slab_map(void) {
+  uint8_t *raw = mmap(NULL, 2*MEM_SLAB_SIZE, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  spyre_assert(raw != MAP_FAILED);
+  uintptr_t start = ((uintptr_t)raw + MEM_SLAB_SIZE - 1) & ~(uintptr_t)(MEM_SLAB_SIZE - 1);
+  size_t head = start - (uintptr_t)raw;
+  if (head > 0) {
+    munmap(raw, head);
+  }
+  munmap((uint8_t *)start + MEM_SLAB_SIZE, MEM_SLAB_SIZE - head);
+  return (SpyreSlab_T *)start;
+}
+
+/* starts a new slab for WORDS and makes it the bump region */
+static void slab_refill(SpyreMemoryMap_T *memory, SpyreSizeClass_T *class, size_t words) {
+  SpyreSlab_T *slab = slab_map();
+  slab->size_class = words;
+  slab->live = 0;
+  slab->evacuate = false;
+  slab->next = class->slabs;
+  class->slabs = slab;
+  memory->nslabs++;
+
+  class->bump = (uint8_t *)(slab + 1);
+  class->bump_end = class->bump + slab_cells(words)*cell_size(words);
+}
+
+static uint8_t *slab_alloc(SpyreMemoryMap_T *memory, size_t words) {
+  SpyreSizeClass_T *class = &memory->classes[words];
+  uint8_t *cell;
+
+  if (class->free != NULL) {
+    cell = class->free;
+    class->free = *(uint8_t **)cell;
+  } else {
+    if (class->bump == class->bump_end) {
+      slab_refill(memory, class, words);
+    }
+    cell = class->bump;
+    class->bump += cell_size(words);
+  }
+
+  memset(cell, 0, cell_size(words));
+  return cell;
+}
+
+/* free seg_ids are kept on an intrusive list threaded through next_free,
+ * which runs parallel to allocs, so churn never mallocs bookkeeping */
+static void resize_bitmaps(SpyreMemoryMap_T *memory, size_t capacity) {
+  memory->live_bits = realloc(memory->live_bits, sizeof(uint64_t) * (capacity/64));
+  memory->mark_bits = realloc(memory->mark_bits, sizeof(uint64_t) * (capacity/64));
+  spyre_assert(memory->live_bits != NULL && memory->mark_bits != NULL);
+}
+
+static void grow_index_table(SpyreMemoryMap_T *memory) {
+  size_t old_capacity = memory->capacity;
+  size_t new_capacity = old_capacity*2;
+
+  memory->allocs = realloc(memory->allocs, sizeof(uint8_t *) * new_capacity);
+  memory->next_free = realloc(memory->next_free, sizeof(uint32_t) * new_capacity);
+  spyre_assert(memory->allocs != NULL && memory->next_free != NULL);
+  memset(&memory->allocs[old_capacity], 0, 
+         sizeof(uint8_t *) * (new_capacity - old_capacity));
+  resize_bitmaps(memory, new_capacity);
+  memset(&memory->live_bits[old_capacity/64], 0, 
+         sizeof(uint64_t) * (new_capacity - old_capacity)/64);
+  memset(&memory->mark_bits[old_capacity/64], 0, 
+         sizeof(uint64_t) * (new_capacity - old_capacity)/64);
+  memory->capacity = new_capacity;
+}
+
+/* a zeroed old-space cell for WORDS payload words */
+static uint8_t *old_alloc(SpyreMemoryMap_T *memory, size_t words) {
+  uint8_t *rawbuf;
+  if (words <= SLAB_MAX_WORDS) {
+    rawbuf = slab_alloc(memory, words);
+  } else {
+    rawbuf = calloc(1, cell_size(words));
+    spyre_assert(rawbuf != NULL);
+  }
+  return rawbuf;
+}
+
+static uint16_t old_flags(size_t words) {
+  return words <= SLAB_MAX_WORDS ? 0 : MEM_LARGE;
+}
+
+/* a segment entering the old space is marked while a cycle is marking,
+ * and while one is sweeping if its seg_id is where the sweep has yet to
+ * reach, so that the sweep does not take it for garbage */
+static bool born_marked(SpyreMemoryMap_T *memory, size_t seg_id) {
+  size_t word = MEM_BIT_WORD(seg_id);
+  return memory->marking 
+         || (memory->sweeping && word >= memory->sweep_cursor && word < memory->sweep_end);
+}
+
+/* allocates a zeroed segment for an object of type TYPE_ID and returns
+ * its seg_id.  small segments start out in the nursery, larger ones go
+ * straight to the old space */
+size_t spymem_alloc(SpyreState_T *S, size_t type_id) {
 
   size_t index;
-  size_t total_size;
-  uint8_t *rawbuf, *buffer;
-  uint8_t **newallocs;
+  size_t words;
+  size_t size;
+  bool young;
+  uint8_t *rawbuf;
   MemoryDescriptor_T *desc;
-  SpyreAddressList_T *addr;
-  SpyreInternalType_T *type = hash_get(S->internal_types, memdesc->type_name);
+  SpyreMemoryMap_T *memory = S->memory;
+  SpyreInternalType_T *type = S->types[type_id];
 
-  if (!type) {
-    fprintf(stderr, "invalid typename '%s'\n", memdesc->type_name);
-    exit(EXIT_FAILURE);
+  /* an incremental cycle gets a mark slice every so many allocations */
+  if (memory->marking && --memory->slice_countdown == 0) {
+    spygc_step(S);
   }
 
-  total_size = (type->nmembers > 0 ? type->nmembers : 1)*8;
+  words = type_words(type);
+  size = cell_size(words);
+  young = words <= MEM_SMALL_WORDS 
+          && size <= (size_t)(memory->nursery_end - memory->nursery);
 
-#ifdef DEBUG
-  printf("allocating %zu bytes for type %s\n", total_size, type->type_name);
+  /* per-object trace, too slow to leave on with DEBUG */
+#ifdef DEBUG_ALLOC
+  printf("allocating %zu bytes for type %s\n", words*8, type->type_name);
 #endif
   
-  /* TODO account for array dimensionality */
-  rawbuf = calloc(1, sizeof(uint8_t)*total_size + sizeof(MemoryDescriptor_T));
-  spyre_assert(rawbuf != NULL);
+  if (young) {
+    /* nursery full?  a minor collection empties it */
+    if (size > (size_t)(memory->nursery_end - memory->nursery_top)) {
+      spygc_minor(S);
+    }
+    rawbuf = memory->nursery_top;
+    memory->nursery_top += size;
+    memset(rawbuf, 0, size);
+  } else {
+    /* the last cycle's garbage is freed a little at a time, whenever an
+     * allocation would otherwise take memory that was never used */
+    if (memory->sweeping && (words > SLAB_MAX_WORDS || memory->classes[words].free == NULL)) {
+      spygc_sweep_step(S);
+    }
+    /* collect before growing the heap past its current target */
+    if (memory->live_bytes >= memory->gc_threshold) {
+      spygc_collect(S);
+    }
+    memory->live_bytes += size;
+    if (memory->live_bytes > S->gc_stats.peak_bytes) {
+      S->gc_stats.peak_bytes = memory->live_bytes;
+    }
+    rawbuf = old_alloc(memory, words);
+  }
   desc = (MemoryDescriptor_T *)&rawbuf[0];
-  buffer = &rawbuf[sizeof(MemoryDescriptor_T)];
-  
-  /* TODO deepcopy */
-  memcpy(desc, memdesc, sizeof(MemoryDescriptor_T));
-  desc->mark = false;
+  desc->type_id = (uint32_t)type_id;
+  desc->flags = young ? MEM_YOUNG : old_flags(words);
+  desc->size_class = (uint16_t)words;
 
   /* if there's a deallocated index, use that */
-  if (S->memory->avail) {
-    addr = S->memory->avail;
-    index = addr->addr;
-    S->memory->avail = addr->next;
-    free(addr);
+  if (memory->free_head != 0) {
+    index = memory->free_head;
+    memory->free_head = memory->next_free[index];
   } else {
-    index = S->memory->index++;
+    index = memory->index++;
+    if (index > UINT32_MAX) {
+      fprintf(stderr, "SPYRE CRITICAL: out of segment ids\n");
+      exit(EXIT_FAILURE);
+    }
   }
   
   /* grow index table if necessary */
-  if (index >= S->memory->capacity) {
-    newallocs = calloc(1, sizeof(uint8_t *) * (S->memory->capacity*2 + 2)); 
-    spyre_assert(newallocs != NULL);
-    memcpy(newallocs, S->memory->allocs, sizeof(uint8_t *) * S->memory->capacity);
-    free(S->memory->allocs);
-    S->memory->allocs = newallocs;
-    S->memory->capacity = S->memory->capacity*2 + 2;
+  if (index >= memory->capacity) {
+    grow_index_table(memory);
   }
 
-  S->memory->allocs[index] = rawbuf;
+  memory->allocs[index] = rawbuf;
+  memory->live_bits[MEM_BIT_WORD(index)] |= MEM_BIT(index);
+  if (!young && born_marked(memory, index)) {
+    spymem_set_mark(memory, index, true);
+  }
+  memory->nsegments++;
+  if (young) {
+    memory->young[memory->nyoung++] = (uint32_t)index;
+  }
 
   return index;
 }
 
+/* moves the young segment SEG_ID into the old space.  its seg_id stays
+ * the same, so nothing that refers to it needs updating.  it is marked
+ * or not as a new old segment would be */
+void spymem_promote(SpyreState_T *S, size_t seg_id) {
+  SpyreMemoryMap_T *memory = S->memory;
+  MemoryDescriptor_T *desc = (MemoryDescriptor_T *)memory->allocs[seg_id];
+  size_t words = desc->size_class;
+  uint8_t *rawbuf = old_alloc(memory, words);
+
+  memcpy(rawbuf, desc, cell_size(words));
+  desc = (MemoryDescriptor_T *)rawbuf;
+  desc->flags = old_flags(words);
+  spymem_set_mark(memory, seg_id, born_marked(memory, seg_id));
+  memory->live_bytes += cell_size(words);
+  if (memory->live_bytes > S->gc_stats.peak_bytes) {
+    S->gc_stats.peak_bytes = memory->live_bytes;
+  }
+  memory->allocs[seg_id] = rawbuf;
+}
+
 void spymem_free(SpyreState_T *S, size_t seg_id) {
   if (seg_id >= S->memory->capacity || !S->memory->allocs[seg_id]) {
     fprintf(stderr, "invalid free");
     exit(EXIT_FAILURE);
   }
-  free(S->memory->allocs[seg_id]);
+  MemoryDescriptor_T *desc = (MemoryDescriptor_T *)S->memory->allocs[seg_id];
+  if (!(desc->flags & MEM_YOUNG)) {
+    S->memory->live_bytes -= cell_size(type_words(S->types[desc->type_id]));
+  }
+  if (desc->flags & MEM_YOUNG) {
+    /* nursery space is reclaimed all at once by the next minor collection */
+  } else if (desc->flags & MEM_LARGE) {
+    free(desc);
+  } else {
+    SpyreSizeClass_T *class = &S->memory->classes[desc->size_class];
+    *(uint8_t **)desc = class->free;
+    class->free = (uint8_t *)desc;
+  }
   S->memory->allocs[seg_id] = NULL;
+  S->memory->live_bits[MEM_BIT_WORD(seg_id)] &= ~MEM_BIT(seg_id);
+  spymem_set_mark(S->memory, seg_id, false);
+  S->memory->nsegments--;
 
   /* seg_id is available for reallocation */
-  SpyreAddressList_T *addr = malloc(sizeof(SpyreAddressList_T));
-  spyre_assert(addr != NULL);
-  addr->addr = seg_id;
-  addr->next = NULL;
-  
-  if (!S->memory->avail) {
-    S->memory->avail = addr;
-  } else {
-    addr->next = S->memory->avail;
-    S->memory->avail = addr;
+  S->memory->next_free[seg_id] = S->memory->free_head;
+  S->memory->free_head = (uint32_t)seg_id;
+
+}
+
+/* compaction.  run once a sweep has finished.  it moves
+ * the survivors of the sparsest slabs of each size class into the free
+ * cells of the densest, unmaps the slabs left empty, and rebuilds the
+ * seg_id free list lowest first so the table can shrink as ids at its
+ * top fall out of use.  a moved segment keeps its seg_id, only its allocs
+ * entry changes */
+
+/* flags the slabs of CLASS to empty.  the fullest slabs that can hold
+ * every survivor are kept */
+static size_t plan_class(SpyreSizeClass_T *class, size_t words) {
+  size_t nslabs = 0;
+  size_t live = 0;
+  size_t per_slab = slab_cells(words);
+
+  for (SpyreSlab_T *slab = class->slabs; slab != NULL; slab = slab->next) {
+    nslabs++;
+    live += slab->live;
+  }
+  size_t keep = (live + per_slab - 1) / per_slab;
+  if (keep >= nslabs) {
+    return 0;
+  }
+
+  SpyreSlab_T **order = malloc(sizeof(SpyreSlab_T *) * nslabs);
+  spyre_assert(order != NULL);
+  size_t n = 0;
+  for (SpyreSlab_T *slab = class->slabs; slab != NULL; slab = slab->next) {
+    order[n++] = slab;
+  }
+  /* insertion sort, fullest first.  classes rarely have many slabs */
+  for (size_t i = 1; i < n; i++) {
+    SpyreSlab_T *slab = order[i];
+    size_t j = i;
+    for (; j > 0 && order[j - 1]->live < slab->live; j--) {
+      order[j] = order[j - 1];
+    }
+    order[j] = slab;
+  }
+  for (size_t i = keep; i < n; i++) {
+    order[i]->evacuate = true;
+  }
+  free(order);
+
+  /* cells on the free list or in the bump tail of an emptied slab must not
+   * be handed out again */
+  uint8_t **link = &class->free;
+  while (*link != NULL) {
+    if (slab_of(*link)->evacuate) {
+      *link = *(uint8_t **)*link;
+    } else {
+      link = (uint8_t **)*link;
+    }
+  }
+  if (class->bump != class->bump_end && slab_of(class->bump)->evacuate) {
+    class->bump = class->bump_end = NULL;
+  }
+
+  return nslabs - keep;
+}
+
+static void release_slabs(SpyreMemoryMap_T *memory, SpyreSizeClass_T *class) {
+  SpyreSlab_T **link = &class->slabs;
+  while (*link != NULL) {
+    SpyreSlab_T *slab = *link;
+    if (slab->evacuate) {
+      *link = slab->next;
+      munmap(slab, MEM_SLAB_SIZE);
+      memory->nslabs--;
+    } else {
+      link = &slab->next;
+    }
+  }
+}
+
+/* whether DESC is an old segment in a slab.  the sweep is lazy, so
+ * compaction can run before collect_young has cleared MEM_REMEMBERED on
+ * the old segments the barrier recorded */
+static bool in_slab(MemoryDescriptor_T *desc) {
+  return desc != NULL && (desc->flags & ~MEM_REMEMBERED) == 0;
+}
+
+static void move_segments(SpyreMemoryMap_T *memory) {
+  for (size_t i = 1; i < memory->index; i++) {
+    MemoryDescriptor_T *desc = (MemoryDescriptor_T *)memory->allocs[i];
+    if (!in_slab(desc) || !slab_of((uint8_t *)desc)->evacuate) {
+      continue;
+    }
+    uint8_t *cell = slab_alloc(memory, desc->size_class);
+    memcpy(cell, desc, cell_size(desc->size_class));
+    memory->allocs[i] = cell;
+#ifdef DEBUG_GC
+    printf("moved seg_id %zu\n", i);
+#endif
+  }
+}
+
+/* drops seg_ids above the highest one in use, relinks the free ones in
+ * ascending order, and halves the table while it is at most a quarter full */
+static void rebuild_index_table(SpyreMemoryMap_T *memory) {
+  size_t top = memory->index;
+  while (top > 1 && memory->allocs[top - 1] == NULL) {
+    top--;
   }
+  memory->index = top;
 
+  memory->free_head = 0;
+  for (size_t i = top; i-- > 1; ) {
+    if (memory->allocs[i] == NULL) {
+      memory->next_free[i] = memory->free_head;
+      memory->free_head = (uint32_t)i;
+    }
+  }
+
+  size_t capacity = memory->capacity;
+  while (capacity/2 >= MEM_MIN_SEG_IDS && capacity/4 >= top) {
+    capacity /= 2;
+  }
+  if (capacity < memory->capacity) {
+    memory->allocs = realloc(memory->allocs, sizeof(uint8_t *) * capacity);
+    memory->next_free = realloc(memory->next_free, sizeof(uint32_t) * capacity);
+    spyre_assert(memory->allocs != NULL && memory->next_free != NULL);
+    resize_bitmaps(memory, capacity);
+    memory->capacity = capacity;
+  }
 }
 
+/* compacts once the heap has shrunk well below its slabs or its seg_id
+ * table, otherwise does nothing.  the heap is allowed to grow back to
+ * gc_threshold before the next collection, so slabs are only released
+ * when there are more than twice that many, or they would just be mapped
+ * again */
+void spymem_compact(SpyreState_T *S) {
+  SpyreMemoryMap_T *memory = S->memory;
+  bool sparse_slabs = memory->nslabs*MEM_SLAB_SIZE > 2*memory->gc_threshold;
+  bool sparse_ids = memory->capacity > MEM_MIN_SEG_IDS
+                    && memory->capacity/8 > memory->nsegments;
+
+  if (!sparse_slabs && !sparse_ids) {
+    return;
+  }
+
+  if (sparse_slabs) {
+    for (size_t words = 1; words <= MEM_SMALL_WORDS; words++) {
+      for (SpyreSlab_T *slab = memory->classes[words].slabs; slab != NULL; slab = slab->next) {
+        slab->live = 0;
+      }
+    }
+    for (size_t i = 1; i < memory->index; i++) {
+      MemoryDescriptor_T *desc = (MemoryDescriptor_T *)memory->allocs[i];
+      if (in_slab(desc)) {
+        slab_of((uint8_t *)desc)->live++;
+      }
+    }
+
+    size_t emptied = 0;
+    for (size_t words = 1; words <= MEM_SMALL_WORDS; words++) {
+      emptied += plan_class(&memory->classes[words], words);
+    }
+    if (emptied > 0) {
+      move_segments(memory);
+      for (size_t words = 1; words <= MEM_SMALL_WORDS; words++) {
+        release_slabs(memory, &memory->classes[words]);
+      }
+    }
+  }
+
+  rebuild_index_table(memory);
+}
@@ -3,8 +3,26 @@
 
 #include "spyre.h"
 
-size_t spymem_alloc(SpyreState_T *, MemoryDescriptor_T *);
+size_t spymem_alloc(SpyreState_T *, size_t);
 uint8_t *spymem_rawbuf(SpyreState_T *, size_t);
 void spymem_free(SpyreState_T *, size_t);
+void spymem_promote(SpyreState_T *, size_t);
+void spymem_compact(SpyreState_T *);
+
+/* mark and occupancy bitmaps, one word per 64 seg_ids */
+#define MEM_BIT_WORD(seg_id) ((seg_id) / 64)
+#define MEM_BIT(seg_id)      ((uint64_t)1 << ((seg_id) % 64))
+
+static inline bool spymem_marked(SpyreMemoryMap_T *memory, size_t seg_id) {
+  return (memory->mark_bits[MEM_BIT_WORD(seg_id)] & MEM_BIT(seg_id)) != 0;
+}
+
+static inline void spymem_set_mark(SpyreMemoryMap_T *memory, size_t seg_id, bool mark) {
+  if (mark) {
+    memory->mark_bits[MEM_BIT_WORD(seg_id)] |= MEM_BIT(seg_id);
+  } else {
+    memory->mark_bits[MEM_BIT_WORD(seg_id)] &= ~MEM_BIT(seg_id);
+  }
+}
 
 #endif
@@ -45,7 +45,7 @@ typedef struct ParsedFunctionHeader {
 typedef struct ParsedMethodHeader {
   Declaration_T *header;
   Declaration_T *args;
-  char *struct_name;
+  const char *struct_name;
 } ParsedMethodHeader_T;
 
 static const OperatorDescriptor_T prec_table[255] = {
@@ -118,9 +118,7 @@ static Datatype_T *make_datatype(const char *type_name, unsigned arrdim, unsigne
   Datatype_T *dt = malloc(sizeof(Datatype_T));
   assert(dt);
 
-  dt->type_name = malloc(strlen(type_name) + 1);
-  assert(dt->type_name);
-  strcpy(dt->type_name, type_name);
+  dt->type_name = intern(type_name);
 
   dt->arrdim   = arrdim;
   dt->ptrdim   = ptrdim;
@@ -140,13 +138,7 @@ static Datatype_T *make_empty_datatype(const char *type_name) {
   Datatype_T *dt = calloc(1, sizeof(Datatype_T));
   assert(dt);
 
-  if (type_name != NULL) {
-    dt->type_name = malloc(strlen(type_name) + 1);
-    assert(dt->type_name);
-    strcpy(dt->type_name, type_name);
-  } else {
-    dt->type_name = NULL;
-  }
+  dt->type_name = type_name != NULL ? intern(type_name) : NULL;
 
   return dt;
 }
@@ -182,6 +174,7 @@ static Declaration_T *empty_decl() {
   decl->dt = NULL;
   decl->next = NULL;
   decl->local_index = 0;
+  decl->in_frame = false;
   return decl;
 }
 
@@ -298,7 +291,7 @@ static inline LexToken_T *at(ParseState_T *P) {
 
 static inline void advance(ParseState_T *P, int n) {
   for (int i = 0; i < n && P->tok != NULL; i++) {
-    P->tok = P->tok->next;
+    P->tok = lex_next(P->L, P->tok);
   }
 }
 
@@ -308,7 +301,7 @@ static LexToken_T *peek(ParseState_T *P, int n) {
     if (token == NULL) {
       return NULL;
     }
-    token = token->next;
+    token = lex_next(P->L, token);
   }
   return token;
 }
@@ -318,7 +311,7 @@ static bool on_string(ParseState_T *P, const char *id, LexToken_T *tok) {
   if (t == NULL) {
     return false;
   }
-  return !strcmp(t->as_string, id);
+  return t->as_string != NULL && !strcmp(t->as_string, id);
 }
 
 static bool on_type(ParseState_T *P, LexTokenType_T type, LexToken_T *tok) {
@@ -331,7 +324,7 @@ static bool on_type(ParseState_T *P, LexTokenType_T type, LexToken_T *tok) {
 
 static void eat(ParseState_T *P, const char *id) {
   if (!on_string(P, id, NULL)) {
-    parse_err(P, "expected token '%s', got '%s'", id, P->tok->as_string);
+    parse_err(P, "expected token '%s', got '%s'", id, lex_token_text(P->L, P->tok));
   }
   advance(P, 1);
 }
@@ -691,9 +684,7 @@ static NodeExpression_T *parse_expression(ParseState_T *P, ASTNode_T *nodeparent
         } else {
           
           node = empty_expnode(EXP_IDENTIFIER, t->lineno);
-          node->identval = malloc(strlen(t->as_string) + 1);
-          assert(node->identval);
-          strcpy(node->identval, t->as_string);
+          node->identval = t->as_string;
           expstack_push(&postfix, node);
         safe_eat(P);
         }
@@ -770,18 +761,14 @@ static NodeExpression_T *parse_expression(ParseState_T *P, ASTNode_T *nodeparent
         safe_eat(P);
         break;
       default:
-        parse_err(P, "unexpected token '%s' when parsing expression", t->as_string);
+        parse_err(P, "unexpected token '%s' when parsing expression", lex_token_text(P->L, t));
     }
 
     /* if it's a unary or binary operator, write as_string value */
     if (node->type == EXP_UNARY) {
-      node->unop->as_string = malloc(strlen(t->as_string) + 1);
-      assert(node->unop->as_string);
-      strcpy(node->unop->as_string, t->as_string);
+      node->unop->as_string = t->as_string;
     } else if (node->type == EXP_BINARY) {
-      node->binop->as_string = malloc(strlen(t->as_string) + 1);
-      assert(node->binop->as_string);
-      strcpy(node->binop->as_string, t->as_string);
+      node->binop->as_string = t->as_string;
     }
 
     prev = t;
@@ -881,7 +868,7 @@ static NodeExpression_T *parse_expression(ParseState_T *P, ASTNode_T *nodeparent
  * the condition ends.  this function finds a mark. */
 static void mark_operator(ParseState_T *P, uint8_t inc, uint8_t end) {
   size_t mark_count = 0;
-  for (LexToken_T *t = P->tok; t != NULL; t = t->next) {
+  for (LexToken_T *t = P->tok; t != NULL; t = lex_next(P->L, t)) {
     if (t->type != TOKEN_OPERATOR) {
       continue;
     }
@@ -898,6 +885,7 @@ static void mark_operator(ParseState_T *P, uint8_t inc, uint8_t end) {
   parse_err(P, "unexpected EOF while parsing expression.");
 }
 
+/* TYPE_NAME is a symbol, see intern.h, or NULL for a token that has none */
 static Datatype_T *datatype_from_name(ParseState_T *P, const char *type_name) {
   Datatype_T *ret;
   Datatype_T *checktypes[] = {
@@ -906,8 +894,11 @@ static Datatype_T *datatype_from_name(ParseState_T *P, const char *type_name) {
     P->builtin->char_t,
     P->builtin->bool_t
   };
+  if (type_name == NULL) {
+    return NULL;
+  }
   for (size_t i = 0; i < sizeof(checktypes)/sizeof(Datatype_T *); i++) {
-    if (!strcmp(checktypes[i]->type_name, type_name)) {
+    if (checktypes[i]->type_name == type_name) {
       return clone_datatype(checktypes[i]);
     }
   }
@@ -918,7 +909,7 @@ static Datatype_T *datatype_from_name(ParseState_T *P, const char *type_name) {
 static Datatype_T *parse_datatype(ParseState_T *P) {
   Datatype_T *dt = datatype_from_name(P, P->tok->as_string); 
   if (!dt) {
-    parse_err(P, "unknown typename '%s'", P->tok->as_string);
+    parse_err(P, "unknown typename '%s'", lex_token_text(P->L, P->tok));
   }
   safe_eat(P);
   while (on_string(P, "[", NULL)) {
@@ -976,10 +967,10 @@ static void parse_expression_node(ParseState_T *P) {
 static Declaration_T *parse_declaration(ParseState_T *P) {
   Declaration_T *decl = empty_decl();
   if (!on_type(P, TOKEN_IDENTIFIER, NULL)) {
-    parse_err(P, "expected identifier in declaration, got token '%s'\n", P->tok->as_string);
+    parse_err(P, "expected identifier in declaration, got token '%s'\n", 
+              lex_token_text(P->L, P->tok));
   }
-  decl->name = malloc(strlen(P->tok->sval) + 1);
-  strcpy(decl->name, P->tok->sval);
+  decl->name = P->tok->sval;
   safe_eat(P);
   eat(P, ":");
   decl->dt = parse_datatype(P);
@@ -1108,9 +1099,7 @@ static ParsedMethodHeader_T parse_method_header(ParseState_T *P) {
   dt->fdesc->nargs = 0;
 
   /* copy over struct name */
-  parsed.struct_name = malloc(strlen(struct_name) + 1);
-  assert(parsed.struct_name != NULL);
-  strcpy(parsed.struct_name, struct_name);
+  parsed.struct_name = struct_name;
   
   safe_eat(P);
   eat(P, ".");
@@ -1119,9 +1108,7 @@ static ParsedMethodHeader_T parse_method_header(ParseState_T *P) {
   if (!on_type(P, TOKEN_IDENTIFIER, NULL)) {
     parse_err(P, "expected name of method");
   } 
-  header->name = malloc(strlen(P->tok->as_string) + 1);
-  assert(header->name);
-  strcpy(header->name, P->tok->as_string);
+  header->name = P->tok->as_string;
 
   safe_eat(P);
 
@@ -1133,7 +1120,7 @@ static ParsedMethodHeader_T parse_method_header(ParseState_T *P) {
     }
     if (!on_string(P, ")", NULL) && !on_string(P, ",", NULL)) {
       parse_err(P, "expected ')' or ',' to follow function argument.  Got token '%s'",
-          P->tok->as_string);
+          lex_token_text(P->L, P->tok));
     }
     if (on_string(P, ",", NULL)) {
       safe_eat(P);
@@ -1193,9 +1180,7 @@ static ParsedFunctionHeader_T parse_function_header(ParseState_T *P) {
   if (!on_type(P, TOKEN_IDENTIFIER, NULL)) {
     parse_err(P, "expected function identifier");
   }
-  header->name = malloc(strlen(P->tok->as_string) + 1);
-  assert(header->name);
-  strcpy(header->name, P->tok->as_string);
+  header->name = P->tok->as_string;
 
   safe_eat(P);
   eat(P, "(");
@@ -1207,7 +1192,7 @@ static ParsedFunctionHeader_T parse_function_header(ParseState_T *P) {
     }
     if (!on_string(P, ")", NULL) && !on_string(P, ",", NULL)) {
       parse_err(P, "expected ')' or ',' to follow function argument.  Got token '%s'",
-          P->tok->as_string);
+          lex_token_text(P->L, P->tok));
     }
     if (on_string(P, ",", NULL)) {
       safe_eat(P);
@@ -1284,9 +1269,7 @@ static void parse_function(ParseState_T *P) {
   Declaration_T *args = header.args;
 
   /* copy details into fnode */
-  fnode->func_name = malloc(strlen(decl->name) + 1);
-  assert(fnode->func_name);
-  strcpy(fnode->func_name, decl->name);
+  fnode->func_name = decl->name;
   fnode->dt = decl->dt;
   fnode->args = args;
   fnode->rettype = fnode->dt->fdesc->return_type;
@@ -1343,9 +1326,7 @@ static void parse_method(ParseState_T *P) {
   /* copy details into fnode */
   fnode->is_method = true;
   fnode->struct_parent = struct_parent;
-  fnode->func_name = malloc(strlen(decl->name) + 1);
-  assert(fnode->func_name);
-  strcpy(fnode->func_name, decl->name);
+  fnode->func_name = decl->name;
   fnode->dt = decl->dt;
   fnode->args = args;
   fnode->rettype = fnode->dt->fdesc->return_type;
@@ -1489,7 +1470,8 @@ static ParseState_T *init_parsestate(LexState_T *L) {
   P->block = P->root;
   P->backnode = NULL;
 
-  P->tok = L->tokens;
+  P->L = L;
+  P->tok = L->ntokens > 0 ? L->tokens : NULL;
 
   P->usertypes = hash_init();
 
@@ -3,6 +3,7 @@
 
 #include "lex.h"
 #include "hash.h"
+#include "intern.h"
 
 struct ASTNode;
 struct FunctionDescriptor;
@@ -46,7 +47,7 @@ typedef enum LeafSide {
 } LeafSide_T;
 
 typedef struct Datatype {
-  char *type_name;          /* type_name id */ 
+  const char *type_name;    /* type_name id, interned */ 
   unsigned arrdim;          /* array dimension */
   unsigned ptrdim;          /* pointer dimension */
   unsigned primsize;        /* size in bytes.  N/A if not primitive */
@@ -61,13 +62,14 @@ typedef struct Datatype {
 } Datatype_T;
 
 typedef struct Declaration {
-  char *name;
+  const char *name;         /* interned */
   Datatype_T *dt;
   struct Declaration *next;
   union {
     size_t local_index;
     size_t struct_index;
   };
+  bool in_frame; /* struct local whose object never escapes, see gen.c */
 } Declaration_T;
 
 typedef struct FunctionDescriptor {
@@ -92,14 +94,14 @@ typedef struct BinaryOpNode {
   struct NodeExpression *me;
   struct NodeExpression *left_operand;
   struct NodeExpression *right_operand;
-  char *as_string;
+  const char *as_string;
   uint8_t optype;
 } BinaryOpNode_T;
 
 typedef struct UnaryOpNode {
   struct NodeExpression *me;
   struct NodeExpression *operand;
-  char *as_string;
+  const char *as_string;
   uint8_t optype;
 } UnaryOpNode_T;
 
@@ -133,7 +135,7 @@ typedef struct NodeExpression {
   union {
     int64_t ival;
     double fval;
-    char *identval;
+    const char *identval;   /* interned */
     BinaryOpNode_T *binop;
     UnaryOpNode_T *unop;
     IndexNode_T *inop;
@@ -173,7 +175,7 @@ typedef struct NodeReturn {
 } NodeReturn_T;
 
 typedef struct NodeFunction {
-  char *func_name;
+  const char *func_name;
   bool is_method;
   Datatype_T *struct_parent;
   Datatype_T *dt;
@@ -1,24 +1,51 @@
+#define _DEFAULT_SOURCE
 #include <stdio.h>
 #include <string.h>
 #include <math.h>
 #include <assert.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include "spyre.h"
 #include "hash.h"
 #include "gc.h"
 #include "memory.h"
 #include "lib_io.h"
+#include "load.h"
+#include "marker.h"
 
 /* this file is the meat of the Spyre virtual machine.  It loads a 
  * spyre bytecode file and executes it accordingly. */
 
-#define MEMORY_INITIAL_CAPACITY 128
-#define STACK_INITIAL_CAPACITY 1024
+#define MEMORY_INITIAL_CAPACITY MEM_MIN_SEG_IDS
+#define STACK_DEFAULT_SIZE      (64 * 1024 * 1024)
+#define HEAP_DEFAULT_INITIAL    (4 * 1024 * 1024)
+#define HEAP_DEFAULT_GROWTH     2.0
+#define NURSERY_DEFAULT_SIZE    (512 * 1024)
+#define STACK_GUARD_SIZE        (64 * 1024)
+#define CFUNC_INITIAL_CAPACITY  16
+#define TYPES_INITIAL_CAPACITY  16
+
+/* the VM stack is one reserved mapping with an inaccessible guard zone on
+ * either side.  pages are only backed by memory once touched, so a large
+ * reservation costs nothing until it is used, and running off either end
+ * faults instead of corrupting the heap.  the SIGSEGV handler walks this
+ * list to turn such a fault into a clean error */
+typedef struct SpyreStackGuard {
+  uintptr_t reserve_lo;
+  uintptr_t reserve_hi;
+  uintptr_t usable_lo;
+  uintptr_t usable_hi;
+  struct SpyreStackGuard *next;
+} SpyreStackGuard_T;
+
+static SpyreStackGuard_T *stack_guards = NULL;
+static struct sigaction previous_segv;
 
 /* used as closure argument when loading in struct members */
 typedef struct MemberRegistrationHelper {
   SpyreState_T *S;
   SpyreInternalType_T *parent;
-  size_t mbr_index;
 } MemberRegistrationHelper_T;
 
 void spyre_assert(bool cond) {
@@ -28,8 +55,18 @@ void spyre_assert(bool cond) {
   }
 }
 
-static void register_type(SpyreState_T *S, SpyreInternalType_T *type) {
+/* interns TYPE under the next dense type id.  the loader rewrites ALLOC
+ * operands to these ids, so the heap never looks a type up by name */
+void spyre_register_type(SpyreState_T *S, SpyreInternalType_T *type) {
   hash_insert(S->internal_types, type->type_name, type);
+
+  if (S->ntypes >= S->type_capacity) {
+    S->type_capacity *= 2;
+    S->types = realloc(S->types, sizeof(SpyreInternalType_T *) * S->type_capacity);
+    spyre_assert(S->types != NULL);
+  }
+  type->type_id = S->ntypes;
+  S->types[S->ntypes++] = type;
 }
 
 SpyreInternalType_T *get_type(SpyreState_T *S, const char *type_name) {
@@ -43,6 +80,10 @@ static void init_types(SpyreState_T *S) {
                       *type_bool;
 
   S->internal_types = hash_init();
+  S->ntypes = 0;
+  S->type_capacity = TYPES_INITIAL_CAPACITY;
+  S->types = malloc(sizeof(SpyreInternalType_T *) * S->type_capacity);
+  spyre_assert(S->types != NULL);
 
   type_int = malloc(sizeof(SpyreInternalType_T));
   spyre_assert(type_int);
@@ -62,9 +103,9 @@ static void init_types(SpyreState_T *S) {
   type_bool->nmembers = 0;
   type_bool->members = NULL;
 
-  register_type(S, type_int);
-  register_type(S, type_float);
-  register_type(S, type_bool);
+  spyre_register_type(S, type_int);
+  spyre_register_type(S, type_float);
+  spyre_register_type(S, type_bool);
 
 }
 
@@ -73,23 +114,119 @@ static void init_memory(SpyreState_T *S) {
   spyre_assert(S->memory);
   S->memory->index = 1;
   S->memory->capacity = MEMORY_INITIAL_CAPACITY;
-  S->memory->avail = NULL;
+  S->memory->free_head = 0;
+  S->memory->nsegments = 0;
+  S->memory->nslabs = 0;
   S->memory->allocs = calloc(1, sizeof(uint8_t *) * MEMORY_INITIAL_CAPACITY);
-  S->memory->localtags = NULL;
-  spyre_assert(S->memory->allocs);
+  S->memory->next_free = malloc(sizeof(uint32_t) * MEMORY_INITIAL_CAPACITY);
+  S->memory->live_bits = calloc(MEMORY_INITIAL_CAPACITY/64, sizeof(uint64_t));
+  S->memory->live_bytes = 0;
+  S->memory->gc_threshold = S->config.heap_initial;
+  S->memory->mark_bits = calloc(MEMORY_INITIAL_CAPACITY/64, sizeof(uint64_t));
+  S->memory->gray = NULL;
+  S->memory->ngray = 0;
+  S->memory->gray_capacity = 0;
+  S->memory->marking = false;
+  S->memory->slice_countdown = 0;
+  S->memory->sweeping = false;
+  S->memory->sweep_cursor = 0;
+  S->memory->sweep_end = 0;
+  S->memory->swept_bytes = 0;
+  memset(S->memory->classes, 0, sizeof(S->memory->classes));
+  spyre_assert(S->memory->allocs && S->memory->next_free);
+  spyre_assert(S->memory->live_bits && S->memory->mark_bits);
+
+  /* every young segment takes at least a header and one word, which
+   * bounds how many seg_ids the nursery can hold */
+  size_t nursery_size = S->config.nursery_size;
+  size_t max_young = nursery_size / (sizeof(MemoryDescriptor_T) + sizeof(size_t));
+  S->memory->nursery = nursery_size > 0 ? malloc(nursery_size) : NULL;
+  S->memory->nursery_top = S->memory->nursery;
+  S->memory->nursery_end = nursery_size > 0 ? S->memory->nursery + nursery_size : NULL;
+  S->memory->young = max_young > 0 ? malloc(sizeof(uint32_t) * max_young) : NULL;
+  S->memory->nyoung = 0;
+  S->memory->remembered = NULL;
+  S->memory->nremembered = 0;
+  S->memory->remembered_capacity = 0;
+  spyre_assert(nursery_size == 0 || S->memory->nursery != NULL);
+  spyre_assert(max_young == 0 || S->memory->young != NULL);
+}
+
+static void init_marker(SpyreState_T *S) {
+  size_t nthreads = S->config.gc_threads;
+  if (nthreads == 0) {
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    nthreads = ncpus > 0 ? (size_t)ncpus : 1;
+  }
+  S->marker = spymark_init(S, nthreads);
 }
 
 static void init_libs(SpyreState_T *S) {
   S->cfuncs = hash_init();
+  S->ncfuncs = 0;
+  S->cfunc_capacity = CFUNC_INITIAL_CAPACITY;
+  S->cfunc_table = malloc(sizeof(SpyreFunction_T *) * S->cfunc_capacity);
+  spyre_assert(S->cfunc_table != NULL);
 
   io_init(S);
 }
 
+static void stack_fault_handler(int sig, siginfo_t *info, void *context) {
+  static const char overflow[]  = "SPYRE CRITICAL: stack overflow\n";
+  static const char underflow[] = "SPYRE CRITICAL: stack underflow\n";
+  uintptr_t addr = (uintptr_t)info->si_addr;
+
+  for (SpyreStackGuard_T *g = stack_guards; g != NULL; g = g->next) {
+    if (addr >= g->reserve_lo && addr < g->reserve_hi) {
+      if (addr >= g->usable_hi) {
+        write(STDERR_FILENO, overflow, sizeof(overflow) - 1);
+      } else {
+        write(STDERR_FILENO, underflow, sizeof(underflow) - 1);
+      }
+      _exit(EXIT_FAILURE);
+    }
+  }
+
+  /* not a VM stack fault.  restore whatever was installed before us, the
+   * faulting instruction then reruns under that disposition */
+  sigaction(SIGSEGV, &previous_segv, NULL);
+}
+
 static void init_stack(SpyreState_T *S) {
-  S->stack = malloc(sizeof(uint8_t) * STACK_INITIAL_CAPACITY);
-  spyre_assert(S->stack != NULL);
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  size_t size = (S->config.max_stack_size + page - 1) / page * page;
+  size_t guard = (STACK_GUARD_SIZE + page - 1) / page * page;
+  uint8_t *reserve;
+  SpyreStackGuard_T *g;
+
+  reserve = mmap(NULL, size + 2*guard, PROT_NONE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  spyre_assert(reserve != MAP_FAILED);
+  spyre_assert(mprotect(reserve + guard, size, PROT_READ | PROT_WRITE) == 0);
+
+  g = malloc(sizeof(SpyreStackGuard_T));
+  spyre_assert(g != NULL);
+  g->reserve_lo = (uintptr_t)reserve;
+  g->reserve_hi = (uintptr_t)(reserve + size + 2*guard);
+  g->usable_lo = (uintptr_t)(reserve + guard);
+  g->usable_hi = (uintptr_t)(reserve + guard + size);
+
+  /* first stack?  install the fault handler */
+  if (stack_guards == NULL) {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = stack_fault_handler;
+    action.sa_flags = SA_SIGINFO;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGSEGV, &action, &previous_segv);
+  }
+  g->next = stack_guards;
+  stack_guards = g;
+
+  S->stack = reserve + guard;
+  S->stack_size = size;
   S->sp = 0;
-  S->ip = 0;
+  S->ip = NULL;
   S->bp = 0;
 }
 
@@ -109,6 +246,16 @@ void spyre_register_cfunc(SpyreState_T *S, const char *name,
   insert->func = cfunc;
   hash_insert(S->cfuncs, insert->name, insert);
 
+  /* give it a dense index so the loader can patch CCALL operands */
+  if (S->ncfuncs >= S->cfunc_capacity) {
+    S->cfunc_capacity *= 2;
+    S->cfunc_table = realloc(S->cfunc_table, 
+                             sizeof(SpyreFunction_T *) * S->cfunc_capacity);
+    spyre_assert(S->cfunc_table != NULL);
+  }
+  insert->index = S->ncfuncs;
+  S->cfunc_table[S->ncfuncs++] = insert;
+
 }
 
 int64_t spyre_pop_int(SpyreState_T *S) {
@@ -140,10 +287,6 @@ static inline void spyre_push_word(SpyreState_T *S, uint64_t word) {
   S->sp += sizeof(uint64_t);
 }
 
-size_t spyre_local_asptr(SpyreState_T *S, size_t local_index) {
-  return *(size_t *)&S->stack[S->bp + local_index*sizeof(size_t)];
-}
-
 /* returns pointer to memory descriptor at the head of the buffer
  * located at seg_id */
 static MemoryDescriptor_T *spyre_typedata(SpyreState_T *S, size_t seg_id) {
@@ -154,290 +297,417 @@ static MemoryDescriptor_T *spyre_typedata(SpyreState_T *S, size_t seg_id) {
   return (MemoryDescriptor_T *)&rawbuf[0];
 }
 
-static uint8_t read_u8(SpyreState_T *S) {
-  uint8_t v = S->code[S->ip];
-  S->ip += 1;
-  return v;
-}
-
-static int64_t read_i64(SpyreState_T *S) {
-  int64_t v = *(int64_t *)&S->code[S->ip];
-  S->ip += sizeof(int64_t);
-  return v;
+/* does VALUE name a segment still in the nursery? */
+static inline bool spyre_is_young(SpyreState_T *S, uint64_t value) {
+  uint8_t *rawbuf;
+  if (value >= S->memory->capacity || (rawbuf = S->memory->allocs[value]) == NULL) {
+    return false;
+  }
+  return ((MemoryDescriptor_T *)rawbuf)->flags & MEM_YOUNG;
 }
 
-static uint64_t read_u64(SpyreState_T *S) {
-  uint64_t v = *(uint64_t *)&S->code[S->ip];
-  S->ip += sizeof(uint64_t);
-  return v;
+/* frees everything spyload_decode built for the last program */
+static void release_code(SpyreState_T *S) {
+  free(S->cells);
+  free(S->stackmaps);
+  free(S->stackmap_words);
+  S->cells = NULL;
+  S->ncells = 0;
+  S->stackmaps = NULL;
+  S->nstackmaps = 0;
+  S->stackmap_words = NULL;
 }
 
-static void spyre_execute(SpyreState_T *S, uint8_t *bytecode) {
-
-  uint8_t opcode;
-  bool running = true;
+/* the interpreter loop keeps ip, sp and bp in locals so the compiler can
+ * hold them in registers.  they are written back to the state (VM_SYNC_OUT)
+ * before anything that may inspect or modify the state from outside the
+ * loop, i.e. C functions, allocation and garbage collection, and are
+ * reloaded afterwards (VM_SYNC_IN).  ip points at the pre-decoded cell
+ * being executed */
+#define VM_OP0()      (ip->op0)
+#define VM_OP1()      (ip->op1)
+#define VM_PUSH(v)    (*(int64_t *)&stack[sp] = (v), sp += sizeof(int64_t))
+#define VM_POP()      (sp -= sizeof(int64_t), *(int64_t *)&stack[sp])
+#define VM_TOP()      (*(int64_t *)&stack[sp - sizeof(int64_t)])
+#define VM_SYNC_OUT() (S->ip = ip, S->sp = sp, S->bp = bp)
+#define VM_SYNC_IN()  (ip = S->ip, sp = S->sp, bp = S->bp)
+
+/* dispatch.  by default each handler jumps directly to the next one through
+ * the label address stored in its cell (computed goto).  defining
+ * SPYRE_SWITCH_DISPATCH at build time selects a plain switch on the raw
+ * opcode instead, for compilers without the extension */
+#ifdef SPYRE_SWITCH_DISPATCH
+#define VM_CASE(op)   case op
+#define VM_DISPATCH() continue
+#else
+#define VM_CASE(op)   L_##op
+#define VM_DISPATCH() goto *ip->handler
+#endif
+#define VM_NEXT()     { ip++; VM_DISPATCH(); }
+#define VM_JUMP(to)   { ip = (const SpyreCell_T *)(uintptr_t)(to); VM_DISPATCH(); }
+
+static void spyre_execute(SpyreState_T *S, uint8_t *bytecode, size_t length) {
+
+  /* interpreter registers */
+  const SpyreCell_T *ip;
+  uint8_t *stack = S->stack;
+  size_t sp = S->sp;
+  size_t bp = S->bp;
 
   /* variables for instructions */
   int64_t v0, v1, v2;
-  double f0, f1, f2;
   uint8_t *rawbuf;
-  const char *typename;
-  MemoryDescriptor_T mdesc;
+  MemoryDescriptor_T *desc;
+
+#ifndef SPYRE_SWITCH_DISPATCH
+  static const void *dispatch_table[256] = {
+    [0 ... 255]   = &&L_INS_UNKNOWN,
+    [INS_HALT]    = &&L_INS_HALT,
+    [INS_IPUSH]   = &&L_INS_IPUSH,
+    [INS_IPOP]    = &&L_INS_IPOP,
+    [INS_IADD]    = &&L_INS_IADD,
+    [INS_ISUB]    = &&L_INS_ISUB,
+    [INS_IMUL]    = &&L_INS_IMUL,
+    [INS_IDIV]    = &&L_INS_IDIV,
+    [INS_DUP]     = &&L_INS_DUP,
+    [INS_FEQ]     = &&L_INS_FEQ,
+    [INS_FLE]     = &&L_INS_FLE,
+    [INS_FGE]     = &&L_INS_FGE,
+    [INS_FLT]     = &&L_INS_FLT,
+    [INS_FGT]     = &&L_INS_FGT,
+    [INS_LDL]     = &&L_INS_LDL,
+    [INS_SVL]     = &&L_INS_SVL,
+    [INS_RESL]    = &&L_INS_RESL,
+    [INS_LDMBR]   = &&L_INS_LDMBR,
+    [INS_SVMBR]   = &&L_INS_SVMBR,
+    [INS_ARG]     = &&L_INS_ARG,
+    [INS_SVLS]    = &&L_INS_SVLS,
+    [INS_IPRINT]  = &&L_INS_IPRINT,
+    [INS_FPRINT]  = &&L_INS_UNKNOWN,
+    [INS_PPRINT]  = &&L_INS_UNKNOWN,
+    [INS_FLAGS]   = &&L_INS_FLAGS,
+    [INS_ALLOC]   = &&L_INS_ALLOC,
+    [INS_FREE]    = &&L_INS_UNKNOWN,
+    [INS_ALLOCL]  = &&L_INS_ALLOCL,
+    [INS_ITEST]   = &&L_INS_ITEST,
+    [INS_ICMP]    = &&L_INS_ICMP,
+    [INS_FTEST]   = &&L_INS_UNKNOWN,
+    [INS_FCMP]    = &&L_INS_UNKNOWN,
+    [INS_JMP]     = &&L_INS_JMP,
+    [INS_JZ]      = &&L_INS_JZ,
+    [INS_JNZ]     = &&L_INS_JNZ,
+    [INS_JGT]     = &&L_INS_JGT,
+    [INS_JGE]     = &&L_INS_JGE,
+    [INS_JLT]     = &&L_INS_JLT,
+    [INS_JLE]     = &&L_INS_JLE,
+    [INS_JEQ]     = &&L_INS_JEQ,
+    [INS_JNEQ]    = &&L_INS_JNEQ,
+    [INS_CALL]    = &&L_INS_CALL,
+    [INS_CCALL]   = &&L_INS_CCALL,
+    [INS_IRET]    = &&L_INS_IRET,
+    [INS_RET]     = &&L_INS_RET,
+    [INS_IJEQ]    = &&L_INS_IJEQ,
+    [INS_IJNEQ]   = &&L_INS_IJNEQ,
+    [INS_IJLT]    = &&L_INS_IJLT,
+    [INS_IJLE]    = &&L_INS_IJLE,
+    [INS_IJGT]    = &&L_INS_IJGT,
+    [INS_IJGE]    = &&L_INS_IJGE
+  };
+#endif
 
   S->code = bytecode;
-  S->ip = 0;
-
-  while (running && (opcode = read_u8(S))) {
-    switch (opcode) {
-      case INS_HALT:
-        running = false;
-        break;
-
-      /* arithmetic */
-      case INS_IPUSH:
-        v0 = read_i64(S);
-        spyre_push_int(S, v0);
-        break;
-      case INS_IPOP:
-        spyre_pop_int(S);
-        break;
-      case INS_IADD:
-        v1 = spyre_pop_int(S);
-        v0 = spyre_pop_int(S);
-        spyre_push_int(S, v0 + v1);
-        break;
-      case INS_ISUB:
-        v1 = spyre_pop_int(S);
-        v0 = spyre_pop_int(S);
-        spyre_push_int(S, v0 - v1);
-        break;
-      case INS_IMUL:
-        v1 = spyre_pop_int(S);
-        v0 = spyre_pop_int(S);
-        spyre_push_int(S, v0 * v1);
-        break;
-      case INS_IDIV:
-        v1 = spyre_pop_int(S);
-        v0 = spyre_pop_int(S);
-        spyre_push_int(S, v0 / v1);
-        break;
-
-      /* misc */
-      case INS_DUP:
-	spyre_push_int(S, spyre_top_int(S));
-	break; 
-
-      /* flags */
-      case INS_FEQ:
-	spyre_push_int(S, S->feq);
-	break;
-      case INS_FLE:
-	spyre_push_int(S, !S->fgt);
-	break;
-      case INS_FGE:
-	spyre_push_int(S, S->fge);
-	break;
-      case INS_FLT:
-	spyre_push_int(S, !S->fge);
-	break;
-      case INS_FGT:
-	spyre_push_int(S, S->fgt);
-	break;
-      
-      /* debug */
-      case INS_IPRINT:
-        printf("%lld\n", spyre_pop_int(S));
-        break;
-      case INS_FPRINT:
-        break;
-      case INS_PPRINT:
-        break;
-      case INS_FLAGS:
-	printf("****** FLAGS ******\n");
-	printf("fz : %d\n", S->fz);
-	printf("feq: %d\n", S->feq);
-	printf("fgt: %d\n", S->fgt);
-	printf("fge: %d\n", S->fge);
-	printf("*******************\n");
-	break;
-
-      /* memory management and GC */
-      case INS_ALLOC:
-        v0 = read_u64(S);	
-        mdesc.type_name = (char *)&S->code[v0];
-        mdesc.arrdim = 0;
-        mdesc.arrs = NULL;
-        mdesc.ptrdim = 0;
-        v1 = spymem_alloc(S, &mdesc);
-        spyre_push_ptr(S, v1);
-        break;
-      case INS_FREE:
-        break;
-      case INS_TAGL:
-        v0 = read_u64(S);
-        spygc_track_local(S, v0);
-        break;
-      case INS_UNTAGL:
-        v0 = read_u64(S);
-        spygc_untrack_local(S, v0);
-        break;
-      case INS_UNTAGLS:
-        v0 = read_u64(S);
-        spygc_untrack_locals(S, v0);
-        break;
-      case INS_ARG:
-	v0 = read_u64(S);
-	v1 = *(uint64_t *)&S->stack[S->bp - 24]; /* number of args passed */
-	spyre_push_int(S, *(int64_t *)&S->stack[S->bp - 3*8 - (v1 - v0)*8]);
-	break;
-
-      /* local management */
-      case INS_LDL:
-        v0 = read_u64(S);
-        spyre_push_word(S, *(uint64_t *)&S->stack[S->bp + v0*sizeof(uint64_t)]);
-        break;
-      case INS_SVL:
-        v0 = read_u64(S);
-        v1 = spyre_pop_int(S);
-        *(size_t *)&S->stack[S->bp + v0*sizeof(uint64_t)] = v1;
-        break;
-      case INS_RESL:
-        v0 = read_u64(S);
-        S->sp += v0 * sizeof(size_t);
-        break;
-      case INS_LDMBR:
-        v0 = read_u64(S); /* member index */
-        v1 = spyre_pop_int(S); /* segment id */
-        rawbuf = spymem_rawbuf(S, v1);
-        spyre_push_word(S, *(uint64_t *)&rawbuf[v0 * sizeof(uint64_t)]);
-        break;
-      case INS_SVMBR:
-        v0 = read_u64(S);
-        v1 = spyre_pop_int(S); /* value to save */
-        v2 = spyre_pop_int(S); /* segment id */
-        rawbuf = spymem_rawbuf(S, v2);
-        *(uint64_t *)&rawbuf[v0 * sizeof(uint64_t)] = v1;
-        break;
-      case INS_SVLS:
-	v0 = spyre_pop_int(S); /* value to save */
-	v1 = spyre_pop_int(S); /* local index to save to */
-	*(size_t *)&S->stack[S->bp + v1*sizeof(uint64_t)] = v0;
-	break;
-
-      /* branching */
-      case INS_ITEST:
-        v0 = spyre_pop_int(S);
-        S->fz = (v0 == 0);
-        break;
-      case INS_ICMP:
-        v1 = spyre_pop_int(S);
-        v0 = spyre_pop_int(S);
-        S->feq = (v0 == v1);
-        S->fgt = (v0 > v1);
-        S->fge = (v0 >= v1);
-        break;
-      case INS_FTEST:
-        break;
-      case INS_FCMP:
-        break;
-      case INS_JMP:
-        v0 = read_u64(S);
-        S->ip = v0;
-        break;
-      case INS_JZ:
-        v0 = read_u64(S);
-        if (S->fz) {
-          S->ip = v0;
-        }
-        break;
-      case INS_JNZ:
-        v0 = read_u64(S);
-        if (!S->fz) {
-          S->ip = v0;
-        }
-        break;
-      case INS_JGT:
-        v0 = read_u64(S);
-        if (S->fgt) {
-          S->ip = v0;
-        }
-        break;
-      case INS_JGE:
-        v0 = read_u64(S);
-        if (S->fge) {
-          S->ip = v0;
-        }
-        break;
-      case INS_JLT:
-        v0 = read_u64(S);
-        if (!S->fge) {
-          S->ip = v0;
-        }
-        break;
-      case INS_JLE:
-        v0 = read_u64(S);
-        if (!S->fgt) {
-          S->ip = v0;
-        }
-        break;
-      case INS_JEQ:
-        v0 = read_u64(S);
-        if (S->feq) {
-          S->ip = v0;
-        }
-        break;
-      case INS_JNEQ:
-        v0 = read_u64(S);
-        if (!S->feq) {
-          S->ip = v0;
-        }
-        break;
-      case INS_CALL:
-	v0 = read_u64(S); /* func addr */
-	v1 = read_u64(S); /* num args */	
-	spyre_push_int(S, v1);     /* push number args */
-	spyre_push_ptr(S, S->bp);  /* push base pointer */
-	spyre_push_ptr(S, S->ip);  /* push return address */
-	S->bp = S->sp;
-	S->ip = v0;
-	break;
-      case INS_CCALL: {
-	v0 = read_u64(S); /* func name pointer */
-	v1 = read_u64(S); /* num args */
-
-	SpyreFunction_T *cfunc = hash_get(S->cfuncs, (char *)&S->code[v0]);
-	if (!cfunc) {
-	  printf("unknown C function %s!\n", (char *)&S->code[v0]);
-	  exit(EXIT_FAILURE);
-	}
-    
-	cfunc->func(S);
-
-	break;
+#ifdef SPYRE_SWITCH_DISPATCH
+  S->cells = spyload_decode(S, bytecode, length, NULL);
+#else
+  S->cells = spyload_decode(S, bytecode, length, dispatch_table);
+#endif
+  ip = S->cells;
+
+#ifdef SPYRE_SWITCH_DISPATCH
+  while (true) switch (ip->opcode) {
+#else
+  VM_DISPATCH();
+  {
+#endif
+    VM_CASE(INS_HALT):
+      goto halt;
+
+    /* arithmetic */
+    VM_CASE(INS_IPUSH):
+      v0 = VM_OP0();
+      VM_PUSH(v0);
+      VM_NEXT();
+    VM_CASE(INS_IPOP):
+      (void)VM_POP();
+      VM_NEXT();
+    VM_CASE(INS_IADD):
+      v1 = VM_POP();
+      v0 = VM_POP();
+      VM_PUSH(v0 + v1);
+      VM_NEXT();
+    VM_CASE(INS_ISUB):
+      v1 = VM_POP();
+      v0 = VM_POP();
+      VM_PUSH(v0 - v1);
+      VM_NEXT();
+    VM_CASE(INS_IMUL):
+      v1 = VM_POP();
+      v0 = VM_POP();
+      VM_PUSH(v0 * v1);
+      VM_NEXT();
+    VM_CASE(INS_IDIV):
+      v1 = VM_POP();
+      v0 = VM_POP();
+      VM_PUSH(v0 / v1);
+      VM_NEXT();
+
+    /* misc */
+    VM_CASE(INS_DUP):
+      v0 = VM_TOP();
+      VM_PUSH(v0);
+      VM_NEXT();
+
+    /* flags */
+    VM_CASE(INS_FEQ):
+      VM_PUSH(S->feq);
+      VM_NEXT();
+    VM_CASE(INS_FLE):
+      VM_PUSH(!S->fgt);
+      VM_NEXT();
+    VM_CASE(INS_FGE):
+      VM_PUSH(S->fge);
+      VM_NEXT();
+    VM_CASE(INS_FLT):
+      VM_PUSH(!S->fge);
+      VM_NEXT();
+    VM_CASE(INS_FGT):
+      VM_PUSH(S->fgt);
+      VM_NEXT();
+
+    /* debug */
+    VM_CASE(INS_IPRINT):
+      printf("%lld\n", VM_POP());
+      VM_NEXT();
+    VM_CASE(INS_FLAGS):
+      printf("****** FLAGS ******\n");
+      printf("fz : %d\n", S->fz);
+      printf("feq: %d\n", S->feq);
+      printf("fgt: %d\n", S->fgt);
+      printf("fge: %d\n", S->fge);
+      printf("*******************\n");
+      VM_NEXT();
+
+    /* memory management and GC */
+    VM_CASE(INS_ALLOC):
+      v0 = VM_OP0(); /* type id, resolved at load */
+      VM_SYNC_OUT();
+      v1 = spymem_alloc(S, v0);
+      VM_SYNC_IN();
+      VM_PUSH(v1);
+      VM_NEXT();
+    VM_CASE(INS_ALLOCL):
+      /* a struct the compiler proved never leaves its frame.  its members
+       * are locals, so there is nothing to allocate, only to zero */
+      v0 = VM_OP0(); /* first member slot */
+      v1 = VM_OP1(); /* number of members */
+      memset(&stack[bp + v0*sizeof(uint64_t)], 0, v1 * sizeof(uint64_t));
+      VM_NEXT();
+    VM_CASE(INS_ARG):
+      v0 = VM_OP0();
+      v1 = *(uint64_t *)&stack[bp - 24]; /* number of args passed */
+      VM_PUSH(*(int64_t *)&stack[bp - 3*8 - (v1 - v0)*8]);
+      VM_NEXT();
+
+    /* local management */
+    VM_CASE(INS_LDL):
+      v0 = VM_OP0();
+      VM_PUSH(*(int64_t *)&stack[bp + v0*sizeof(uint64_t)]);
+      VM_NEXT();
+    VM_CASE(INS_SVL):
+      v0 = VM_OP0();
+      v1 = VM_POP();
+      *(int64_t *)&stack[bp + v0*sizeof(uint64_t)] = v1;
+      VM_NEXT();
+    VM_CASE(INS_RESL):
+      v0 = VM_OP0();
+      /* locals start out zeroed so the stack maps never see stale words */
+      memset(&stack[sp], 0, v0 * sizeof(size_t));
+      sp += v0 * sizeof(size_t);
+      VM_NEXT();
+    VM_CASE(INS_LDMBR):
+      v0 = VM_OP0(); /* member index */
+      v1 = VM_POP(); /* segment id */
+      rawbuf = spymem_rawbuf(S, v1);
+      VM_PUSH(*(int64_t *)&rawbuf[v0 * sizeof(uint64_t)]);
+      VM_NEXT();
+    VM_CASE(INS_SVMBR):
+      v0 = VM_OP0();
+      v1 = VM_POP(); /* value to save */
+      v2 = VM_POP(); /* segment id */
+      rawbuf = spymem_rawbuf(S, v2);
+      /* snapshot barrier, see gc.c.  the value being replaced is grayed
+       * while a collection is marking */
+      if (S->memory->marking) {
+        spygc_shade(S, *(uint64_t *)&rawbuf[v0 * sizeof(uint64_t)]);
       }
-      case INS_IRET:
-	v0 = spyre_pop_int(S); /* return value */
-	S->sp = S->bp;
-	S->ip = spyre_pop_ptr(S);
-	S->bp = spyre_pop_ptr(S);
-	S->sp -= spyre_pop_int(S)*8;
-	spyre_push_int(S, v0);
-	break;
-
-      case INS_RET:
-	S->sp = S->bp;
-	S->ip = spyre_pop_ptr(S);
-	S->bp = spyre_pop_ptr(S);
-	S->sp -= spyre_pop_int(S)*8;
-	break;
-      default:
-        break;
-    }
+      *(int64_t *)&rawbuf[v0 * sizeof(uint64_t)] = v1;
+      /* generational barrier.  an old segment now referring into the
+       * nursery is a root for the next minor collection.  the member's
+       * type is not known here, so any value naming a young segment counts */
+      desc = (MemoryDescriptor_T *)rawbuf - 1;
+      if (!(desc->flags & (MEM_YOUNG | MEM_REMEMBERED)) && spyre_is_young(S, v1)) {
+        spygc_remember(S, v2);
+      }
+      VM_NEXT();
+    VM_CASE(INS_SVLS):
+      v0 = VM_POP(); /* value to save */
+      v1 = VM_POP(); /* local index to save to */
+      *(int64_t *)&stack[bp + v1*sizeof(uint64_t)] = v0;
+      VM_NEXT();
+
+    /* branching */
+    VM_CASE(INS_ITEST):
+      v0 = VM_POP();
+      S->fz = (v0 == 0);
+      VM_NEXT();
+    VM_CASE(INS_ICMP):
+      v1 = VM_POP();
+      v0 = VM_POP();
+      S->feq = (v0 == v1);
+      S->fgt = (v0 > v1);
+      S->fge = (v0 >= v1);
+      VM_NEXT();
+    VM_CASE(INS_JMP):
+      VM_JUMP(VM_OP0());
+    VM_CASE(INS_JZ):
+      if (S->fz) {
+        VM_JUMP(VM_OP0());
+      }
+      VM_NEXT();
+    VM_CASE(INS_JNZ):
+      if (!S->fz) {
+        VM_JUMP(VM_OP0());
+      }
+      VM_NEXT();
+    VM_CASE(INS_JGT):
+      if (S->fgt) {
+        VM_JUMP(VM_OP0());
+      }
+      VM_NEXT();
+    VM_CASE(INS_JGE):
+      if (S->fge) {
+        VM_JUMP(VM_OP0());
+      }
+      VM_NEXT();
+    VM_CASE(INS_JLT):
+      if (!S->fge) {
+        VM_JUMP(VM_OP0());
+      }
+      VM_NEXT();
+    VM_CASE(INS_JLE):
+      if (!S->fgt) {
+        VM_JUMP(VM_OP0());
+      }
+      VM_NEXT();
+    VM_CASE(INS_JEQ):
+      if (S->feq) {
+        VM_JUMP(VM_OP0());
+      }
+      VM_NEXT();
+    VM_CASE(INS_JNEQ):
+      if (!S->feq) {
+        VM_JUMP(VM_OP0());
+      }
+      VM_NEXT();
+    VM_CASE(INS_IJEQ):
+      v1 = VM_POP();
+      v0 = VM_POP();
+      if (v0 == v1) {
+        VM_JUMP(VM_OP0());
+      }
+      VM_NEXT();
+    VM_CASE(INS_IJNEQ):
+      v1 = VM_POP();
+      v0 = VM_POP();
+      if (v0 != v1) {
+        VM_JUMP(VM_OP0());
+      }
+      VM_NEXT();
+    VM_CASE(INS_IJLT):
+      v1 = VM_POP();
+      v0 = VM_POP();
+      if (v0 < v1) {
+        VM_JUMP(VM_OP0());
+      }
+      VM_NEXT();
+    VM_CASE(INS_IJLE):
+      v1 = VM_POP();
+      v0 = VM_POP();
+      if (v0 <= v1) {
+        VM_JUMP(VM_OP0());
+      }
+      VM_NEXT();
+    VM_CASE(INS_IJGT):
+      v1 = VM_POP();
+      v0 = VM_POP();
+      if (v0 > v1) {
+        VM_JUMP(VM_OP0());
+      }
+      VM_NEXT();
+    VM_CASE(INS_IJGE):
+      v1 = VM_POP();
+      v0 = VM_POP();
+      if (v0 >= v1) {
+        VM_JUMP(VM_OP0());
+      }
+      VM_NEXT();
+    VM_CASE(INS_CALL):
+      v0 = VM_OP0(); /* func addr */
+      v1 = VM_OP1(); /* num args */
+      VM_PUSH(v1);        /* push number args */
+      VM_PUSH(bp);        /* push base pointer */
+      VM_PUSH((uintptr_t)(ip + 1)); /* push return address */
+      bp = sp;
+      VM_JUMP(v0);
+    VM_CASE(INS_CCALL):
+      v0 = VM_OP0(); /* cfunc index, resolved at load */
+      v1 = VM_OP1(); /* num args */
+      VM_SYNC_OUT();
+      S->cfunc_table[v0]->func(S);
+      VM_SYNC_IN();
+      VM_NEXT();
+    VM_CASE(INS_IRET):
+      v0 = VM_POP(); /* return value */
+      sp = bp;
+      v2 = VM_POP();
+      bp = VM_POP();
+      v1 = VM_POP();
+      sp -= v1*8;
+      VM_PUSH(v0);
+      VM_JUMP(v2);
+    VM_CASE(INS_RET):
+      sp = bp;
+      v2 = VM_POP();
+      bp = VM_POP();
+      v1 = VM_POP();
+      sp -= v1*8;
+      VM_JUMP(v2);
+
+#ifdef SPYRE_SWITCH_DISPATCH
+    default:
+      VM_NEXT();
+#else
+    L_INS_UNKNOWN:
+      VM_NEXT();
+#endif
   }
 
+halt:
+  VM_SYNC_OUT();
+
 }
 
-void spyre_execute_file(const char *fname) {
+void spyre_execute_file(const char *fname, const SpyreConfig_T *config) {
 
   FILE *infile = fopen(fname, "rb");
   if (infile == NULL) {
@@ -445,7 +715,7 @@ void spyre_execute_file(const char *fname) {
     exit(EXIT_FAILURE);
   }
 
-  SpyreState_T *S = spyre_init();
+  SpyreState_T *S = spyre_init(config);
   
   /* read entire file into buffer */
   uint8_t *buffer;
@@ -456,13 +726,19 @@ void spyre_execute_file(const char *fname) {
   buffer = malloc(flen);
   spyre_assert(buffer != NULL);
   fread(buffer, 1, flen, infile);
-  spyre_execute(S, buffer);
-  free(buffer);
-
+  spyre_execute(S, buffer, flen);
   spygc_execute(S);
+  if (S->config.gc_stats) {
+    spygc_report(S, stderr);
+  }
+
+  release_code(S);
+  free(buffer);
 
 }
 
+/* members are laid out one word each in declaration order, the same
+ * struct_index the compiler uses for LDMBR and SVMBR */
 static void map_register_member(const char *key, void *mbr, void *cl) {
   MemberRegistrationHelper_T *helper = cl;
   Declaration_T *member = mbr;
@@ -471,9 +747,8 @@ static void map_register_member(const char *key, void *mbr, void *cl) {
   intmbr->type = get_type(helper->S, member->dt->type_name);
   intmbr->ptrdim = member->dt->ptrdim;
   intmbr->arrdim = member->dt->arrdim;
-  intmbr->byte_offset = sizeof(size_t) * helper->mbr_index;
-  helper->parent->members[helper->mbr_index] = intmbr;
-  helper->mbr_index++;
+  intmbr->byte_offset = sizeof(size_t) * member->struct_index;
+  helper->parent->members[member->struct_index] = intmbr;
 
   if (intmbr->type == NULL) {
     fprintf(stderr, "critical: couldn't find member '%s''s type (%s)\n", 
@@ -497,7 +772,7 @@ static void map_register_type(const char *key, void *dt, void *cl) {
   type->nmembers = datatype->sdesc->members->size;
   type->members = malloc(sizeof(SpyreInternalMember_T) * type->nmembers);
   spyre_assert(type->members);
-  register_type(S, type);
+  spyre_register_type(S, type);
 
   printf("registering type %s\n", key);
 }
@@ -512,7 +787,6 @@ static void map_register_all_members(const char *key, void *dt, void *cl) {
   /* now register each member */
   MemberRegistrationHelper_T helper;
   helper.parent = type;
-  helper.mbr_index = 0;
   helper.S = S;
   hash_foreach(datatype->sdesc->members, map_register_member, &helper);
 }
@@ -520,9 +794,10 @@ static void map_register_all_members(const char *key, void *dt, void *cl) {
 /* execute the FNAME bytecode file with context.  The parse state is
  * assumed to have parsed the file FNAME, and extracted relevant information
  * such as user-defined types (structs) */
-void spyre_execute_with_context(const char *fname, ParseState_T *P) {
+void spyre_execute_with_context(const char *fname, ParseState_T *P,
+                                const SpyreConfig_T *config) {
   
-  SpyreState_T *S = spyre_init();
+  SpyreState_T *S = spyre_init(config);
   SpyreHash_T *usertypes = P->usertypes;
   hash_foreach(usertypes, map_register_type, S);
   hash_foreach(usertypes, map_register_all_members, S);
@@ -542,19 +817,50 @@ void spyre_execute_with_context(const char *fname, ParseState_T *P) {
   buffer = malloc(flen);
   spyre_assert(buffer != NULL);
   fread(buffer, 1, flen, infile);
-  spyre_execute(S, buffer);
+  spyre_execute(S, buffer, flen);
+  spygc_execute(S);
+  if (S->config.gc_stats) {
+    spygc_report(S, stderr);
+  }
+
+  release_code(S);
   free(buffer);
 
-  spygc_execute(S);
+}
 
+void spyre_config_defaults(SpyreConfig_T *config) {
+  config->max_stack_size = STACK_DEFAULT_SIZE;
+  config->heap_initial = HEAP_DEFAULT_INITIAL;
+  config->heap_growth = HEAP_DEFAULT_GROWTH;
+  config->nursery_size = NURSERY_DEFAULT_SIZE;
+  config->gc_threads = 0;
+  config->gc_slice_us = 0;
+  config->gc_stats = false;
+  config->gc_callback = NULL;
+  config->gc_callback_data = NULL;
 }
 
-SpyreState_T *spyre_init() {
+/* creates a new VM instance.  CONFIG may be NULL to use the defaults */
+SpyreState_T *spyre_init(const SpyreConfig_T *config) {
 
   SpyreState_T *S = malloc(sizeof(SpyreState_T));
   spyre_assert(S != NULL);
 
+  if (config != NULL) {
+    S->config = *config;
+  } else {
+    spyre_config_defaults(&S->config);
+  }
+
+  S->cells = NULL;
+  S->ncells = 0;
+  S->stackmaps = NULL;
+  S->nstackmaps = 0;
+  S->stackmap_words = NULL;
+  memset(&S->gc_stats, 0, sizeof(S->gc_stats));
+
   init_memory(S);
+  init_marker(S);
   init_libs(S);
   init_stack(S);
   init_types(S);
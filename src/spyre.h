@@ -48,9 +48,8 @@
 /* memory management and GC */
 #define INS_ALLOC   0xA0
 #define INS_FREE    0xA1
-#define INS_TAGL    0xA2
-#define INS_UNTAGL  0xA3
-#define INS_UNTAGLS 0xA4
+#define INS_SMAP    0xA5 /* stack map pseudo-instruction, stripped at load */
+#define INS_ALLOCL  0xA6 /* zero OP1 locals from OP0, a struct kept in the frame */
 
 /* branching */
 #define INS_ITEST   0xC0
@@ -71,32 +70,96 @@
 #define INS_IRET    0xCF
 #define INS_RET     0xD0
 
+/* fused compare-and-branch: pops b, pops a, jumps if a OP b */
+#define INS_IJEQ    0xD1
+#define INS_IJNEQ   0xD2
+#define INS_IJLT    0xD3
+#define INS_IJLE    0xD4
+#define INS_IJGT    0xD5
+#define INS_IJGE    0xD6
+
 struct SpyreState;
 
-/* at the head of every segment allocation */
+/* MemoryDescriptor_T flags */
+#define MEM_LARGE      0x01 /* allocated on its own rather than from a slab */
+#define MEM_YOUNG      0x02 /* lives in the nursery, see SpyreMemoryMap_T */
+#define MEM_REMEMBERED 0x04 /* old segment already on the remembered set */
+
+/* segments of up to MEM_SMALL_WORDS payload words come from slabs, one
+ * size class per word count.  anything larger is allocated on its own */
+#define MEM_SMALL_WORDS 32
+#define MEM_SLAB_SIZE   (64 * 1024) /* also the alignment of every slab */
+
+/* compaction never shrinks the seg_id table below this many entries.
+ * the table is always a power of two this size or larger, so the bitmaps
+ * that run parallel to it are a whole number of words */
+#define MEM_MIN_SEG_IDS 128
+
+/* at the head of every segment allocation.  kept to one word since most
+ * segments are small structs.  mark bits are not kept here but in
+ * SpyreMemoryMap_T.mark_bits, so a sweep need not read live headers */
 typedef struct MemoryDescriptor {
-  char *type_name;
-  size_t arrdim;
-  size_t *arrs;
-  size_t ptrdim;
-  bool mark;
+  uint32_t type_id;    /* index into SpyreState_T.types */
+  uint16_t flags;
+  uint16_t size_class; /* payload size in words */
 } MemoryDescriptor_T;
 
-typedef struct SpyreAddressList {
-  size_t addr;
-  struct SpyreAddressList *next;
-} SpyreAddressList_T;
+_Static_assert(sizeof(MemoryDescriptor_T) == 8, "segment header must be one word");
+
+/* a block of equally sized cells.  the cells follow the header */
+typedef struct SpyreSlab {
+  struct SpyreSlab *next;
+  size_t size_class;
+  size_t live;   /* survivors, counted when compacting */
+  bool evacuate; /* compaction is moving its cells elsewhere */
+} SpyreSlab_T;
+
+typedef struct SpyreSizeClass {
+  uint8_t *free;     /* freed cells, linked through their first word */
+  uint8_t *bump;     /* never used tail of the newest slab */
+  uint8_t *bump_end;
+  SpyreSlab_T *slabs;
+} SpyreSizeClass_T;
 
 typedef struct SpyreMemoryMap {
 
   /* heap management */
+  SpyreSizeClass_T classes[MEM_SMALL_WORDS + 1]; /* indexed by payload words */
   uint8_t **allocs;
   size_t capacity;
   size_t index; 
-  SpyreAddressList_T *avail;
+  uint32_t *next_free; /* parallel to allocs, links the free seg_ids */
+  uint32_t free_head;  /* most recently freed seg_id, 0 if none */
+  uint64_t *live_bits; /* one bit per seg_id, set while it is allocated */
+  size_t nsegments;    /* seg_ids in use */
+  size_t nslabs;
 
   /* garbage collection */
-  SpyreAddressList_T *localtags;
+  size_t live_bytes;   /* header + payload of every old segment */
+  size_t gc_threshold; /* collect once live_bytes reaches this */
+  uint64_t *mark_bits; /* one bit per seg_id, set once marked.  clear between cycles */
+  size_t *gray;        /* marked segments whose members are not yet scanned */
+  size_t ngray;
+  size_t gray_capacity;
+  bool marking;           /* an incremental cycle is between start and sweep */
+  size_t slice_countdown; /* allocations until its next mark slice */
+  bool sweeping;          /* the last cycle's dead segments are not all freed */
+  size_t sweep_cursor;    /* next word of mark_bits to sweep */
+  size_t sweep_end;       /* words of mark_bits the last cycle could have marked */
+  size_t swept_bytes;     /* live_bytes as the last cycle left them, less its sweep */
+
+  /* young generation.  small segments are bump allocated in the nursery
+   * and copied out to the slabs by the first minor collection they
+   * survive.  the remembered set lists old segments that had a young
+   * seg_id stored into them since the last minor collection */
+  uint8_t *nursery;
+  uint8_t *nursery_top;  /* next free byte */
+  uint8_t *nursery_end;
+  uint32_t *young;       /* seg_ids allocated in the nursery, in order */
+  size_t nyoung;
+  uint32_t *remembered;
+  size_t nremembered;
+  size_t remembered_capacity;
 } SpyreMemoryMap_T;
 
 typedef struct SpyreInternalMember {
@@ -108,24 +171,108 @@ typedef struct SpyreInternalMember {
 
 typedef struct SpyreInternalType {
   char *type_name;
+  size_t type_id;
   size_t nmembers;
   SpyreInternalMember_T **members;
 } SpyreInternalType_T;
 
+/* one pre-decoded instruction.  built from the raw bytecode at load
+ * time, see load.c */
+typedef struct SpyreCell {
+  union {
+    const void *handler; /* label address, threaded dispatch */
+    uint64_t opcode;     /* raw opcode, switch dispatch */
+  };
+  uint64_t op0;
+  uint64_t op1;
+} SpyreCell_T;
+
+/* which local slots of a frame hold references while it is stopped at a
+ * safepoint (ALLOC, CALL or CCALL).  built by the loader from the SMAP
+ * pseudo-instructions the compiler places in front of each safepoint */
+typedef struct SpyreStackMap {
+  size_t cell;    /* index of the safepoint in SpyreState_T.cells */
+  size_t nlocals; /* slots reserved by the frame's RESL */
+  size_t refs;    /* offset of the slot bitmap in stackmap_words */
+} SpyreStackMap_T;
+
 typedef struct SpyreFunction {
   char *name;
+  size_t index; /* slot in SpyreState_T.cfunc_table */
   int (*func)(struct SpyreState *);
 } SpyreFunction_T;
 
+/* what one full collection did.  times are wall clock milliseconds */
+typedef struct SpyreGCCycle {
+  size_t cycle;          /* 1 for the first full collection */
+  double mark_pause_ms;  /* emptying the nursery, graying the roots, finishing the mark */
+  double mark_slices_ms; /* incremental mark slices run between allocations */
+  double sweep_ms;       /* lazy sweep steps, and the final one */
+  size_t freed_objects;
+  size_t freed_bytes;
+  size_t live_bytes;     /* old space once the sweep finished */
+} SpyreGCCycle_T;
+
+/* running totals over every collection so far */
+typedef struct SpyreGCStats {
+  size_t cycles;         /* full collections finished */
+  size_t minor_cycles;
+  double minor_ms;       /* includes those run by full collections */
+  double mark_pause_ms;
+  double mark_slices_ms;
+  double sweep_ms;
+  double max_pause_ms;   /* longest any single collector step held the program */
+  size_t freed_objects;  /* by full collections */
+  size_t freed_bytes;
+  size_t minor_freed_objects; /* died in the nursery */
+  size_t minor_freed_bytes;
+  size_t peak_bytes;     /* highest old space live_bytes */
+  SpyreGCCycle_T current; /* the full collection under way, or the last one */
+} SpyreGCStats_T;
+
+struct SpyreState;
+
+/* runtime options for a VM instance.  fill with spyre_config_defaults
+ * and override fields as needed */
+typedef struct SpyreConfig {
+  size_t max_stack_size; /* bytes reserved for the VM stack */
+  size_t heap_initial;   /* live heap bytes that trigger the first collection */
+  double heap_growth;    /* next trigger is the surviving heap times this */
+  size_t nursery_size;   /* bytes of young generation, 0 allocates everything old */
+  size_t gc_threads;     /* threads marking a full collection, 0 for one per cpu */
+  size_t gc_slice_us;    /* mark incrementally in slices this long, 0 stops the world */
+  bool gc_stats;         /* print a collection summary to stderr when the program ends */
+  /* if set, called with gc_callback_data once each full collection has
+   * finished sweeping.  minor collections do not call it, they only add
+   * to the totals in gc_stats */
+  void (*gc_callback)(struct SpyreState *, const SpyreGCCycle_T *, void *);
+  void *gc_callback_data;
+} SpyreConfig_T;
+
 typedef struct SpyreState {
+  SpyreConfig_T config;
   SpyreMemoryMap_T *memory;
-  SpyreHash_T *internal_types;
-  SpyreHash_T *cfuncs;
+  struct SpyreMarker *marker;   /* parallel mark workers, NULL to mark on one thread */
+  SpyreGCStats_T gc_stats;
+  SpyreHash_T *internal_types;  /* name -> SpyreInternalType_T, used at load */
+  SpyreInternalType_T **types;  /* indexed by type id at run time */
+  size_t ntypes;
+  size_t type_capacity;
+  SpyreHash_T *cfuncs;          /* name -> SpyreFunction_T, used at load */
+  SpyreFunction_T **cfunc_table; /* indexed by CCALL operand at run time */
+  size_t ncfuncs;
+  size_t cfunc_capacity;
   uint8_t *stack;
+  size_t stack_size;
   uint8_t *code;
+  SpyreCell_T *cells;
+  size_t ncells;
+  SpyreStackMap_T *stackmaps;   /* sorted by cell */
+  size_t nstackmaps;
+  uint32_t *stackmap_words;     /* 32 slots per word, bit n is slot n */
   size_t sp;
   size_t bp;
-  size_t ip;
+  const SpyreCell_T *ip;
 
   /* flags */
   uint8_t fz;
@@ -134,12 +281,13 @@ typedef struct SpyreState {
   uint8_t fge;
 } SpyreState_T;
 
-SpyreState_T *spyre_init();
-void spyre_execute_file(const char *);
-void spyre_execute_with_context(const char *, ParseState_T *);
+void spyre_config_defaults(SpyreConfig_T *);
+SpyreState_T *spyre_init(const SpyreConfig_T *);
+void spyre_execute_file(const char *, const SpyreConfig_T *);
+void spyre_execute_with_context(const char *, ParseState_T *, const SpyreConfig_T *);
 void spyre_assert(bool);
 void spyre_register_cfunc(SpyreState_T *, const char *, int (*)(SpyreState_T *));
-size_t spyre_local_asptr(SpyreState_T *, size_t);
+void spyre_register_type(SpyreState_T *, SpyreInternalType_T *);
 int64_t spyre_pop_int(SpyreState_T *S);
 SpyreInternalType_T *get_type(SpyreState_T *, const char *);
 
@@ -42,9 +42,10 @@ static const char *operator_tostring(uint8_t op) {
   return "OP";
 }
 
+/* NAME is a symbol, see intern.h */
 static Declaration_T *search_in_decl_list(Declaration_T *decl, const char *name) {
   while (decl != NULL) {
-    if (!strcmp(decl->name, name)) {
+    if (decl->name == name) {
       return decl;
     }
     decl = decl->next;
@@ -112,7 +113,7 @@ static bool compare_datatypes_strict(Datatype_T *a, Datatype_T *b) {
     && (a->ptrdim == b->ptrdim)
     && (a->arrdim == b->arrdim)
     && (a->is_const == b->is_const)
-    && !strcmp(a->type_name, b->type_name)
+    && a->type_name == b->type_name
   );
 }
 
@@ -126,9 +127,7 @@ static Datatype_T *make_raw_datatype(const char *type_name) {
   dt->ptrdim = 0;
   dt->primsize = 8;
   dt->is_const = false;
-  dt->type_name = malloc(strlen(type_name) + 1);
-  assert(dt->type_name);
-  strcpy(dt->type_name, type_name);
+  dt->type_name = intern(type_name);
   return dt;
 }
 
@@ -136,14 +135,12 @@ static Datatype_T *make_raw_datatype(const char *type_name) {
  * the hashtable containing a struct's members */
 static void destroy_struct_members(const char *key, void *member, void *cl) {
   Declaration_T *decl = member;  
-  free(decl->name);
   destroy_datatype(&decl->dt);
   free(decl);
 }
 
 static void destroy_datatype(Datatype_T **dtp) {
   Datatype_T *dt = *dtp;
-  free(dt->type_name);
 
   /* recursively destroy children? */
   switch (dt->type) {
@@ -174,10 +171,10 @@ static void deepcopy_struct_members(const char *key, void *member, void *cl) {
 static Declaration_T *deepcopy_decl(Declaration_T *decl) {
   Declaration_T *clone = malloc(sizeof(Declaration_T));
   assert(clone);
-  clone->name = malloc(strlen(decl->name) + 1);
-  strcpy(clone->name, decl->name);
+  clone->name = decl->name;
   clone->dt = deepcopy_datatype(decl->dt);
   clone->local_index = decl->local_index;
+  clone->in_frame = decl->in_frame;
   clone->next = NULL;
   return clone;
 }
@@ -193,13 +190,7 @@ static Datatype_T *deepcopy_datatype(Datatype_T *dt) {
   assert(clone);
 
   /* remember: functions don't have a typename */
-  if (dt->type_name != NULL) {
-    clone->type_name = malloc(strlen(dt->type_name) + 1);
-    assert(clone->type_name);
-    strcpy(clone->type_name, dt->type_name);
-  } else {
-    clone->type_name = NULL;
-  }
+  clone->type_name = dt->type_name;
   clone->arrdim = dt->arrdim;
   clone->ptrdim = dt->ptrdim;
   clone->primsize = dt->primsize;